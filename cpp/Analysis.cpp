@@ -0,0 +1,720 @@
+#include "Environment.h"
+#include "Interpreter.h"
+#include "MAL.h"
+#include "Types.h"
+#include "Validation.h"
+
+#include <set>
+
+// A pass over each top-level form before it's evaluated. Calls of the
+// integer builtins whose arguments are constants are replaced by malFolded
+// nodes, which keep hold of the original call in case the builtin is ever
+// rebound. Quoted forms and the arguments of macro calls are data rather
+// than code, so they are left alone, as is anything whose head can't be
+// resolved yet.
+//
+// fn* forms inside a function, let* or catch* become malFnForm nodes when
+// the free names of their bodies can all be found, so that the lambdas they
+// make only keep hold of the locals they use.
+//
+// Quasiquote templates are compiled to malTemplate nodes, which build their
+// lists directly instead of expanding to calls of cons and concat each time
+// they're evaluated.
+//
+// Calls of get, and of assoc with one key, whose key is a keyword become
+// malFieldSite nodes, which cache where that field is in a record.
+//
+// Calls of protocol methods become malDispatchSite nodes, which cache the
+// implementations for the types which reach each of them.
+
+typedef std::set<String> Names;
+
+struct Analysis {
+    malEnvPtr env;
+    Names     defined; // def!'d anywhere in the form
+    Names     nested;  // def!'d inside a fn*, let* or catch*
+    Names     macros;  // defmacro!'d anywhere in the form
+};
+
+// What's bound around a form: its locals, those of them which a let* has
+// yet to bind, the number of frames between it and the env which the whole
+// form is evaluated in, and whether a macro call might def! a name in any
+// of those frames.
+struct Scope {
+    Scope() : frames(0), mayRebind(false) { }
+
+    Names locals;
+    Names pending;
+    int   frames;
+    bool  mayRebind;
+};
+
+static malValuePtr analyze(malValuePtr ast, const Scope& scope,
+                           Analysis& analysis);
+
+static const malSymbol* symbolAt(const malSequence* seq, int index)
+{
+    return index < seq->count() ? DYNAMIC_CAST(malSymbol, seq->item(index))
+                                : NULL;
+}
+
+static void collectDefinitions(malValuePtr ast, Analysis& analysis,
+                               bool isNested)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, ast);
+    if (!seq) {
+        return;
+    }
+    const malSymbol* head = symbolAt(seq, 0);
+    const malSymbol* name = symbolAt(seq, 1);
+    if (head && DYNAMIC_CAST(malList, ast)) {
+        const String& special = head->value();
+        if (name && (special == "def!")) {
+            analysis.defined.insert(name->value());
+            if (isNested) {
+                analysis.nested.insert(name->value());
+            }
+        }
+        else if (name && (special == "defmacro!")) {
+            analysis.macros.insert(name->value());
+        }
+        else if ((special == "fn*") || (special == "let*") ||
+                 (special == "catch*")) {
+            isNested = true;
+        }
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        collectDefinitions(*it, analysis, isNested);
+    }
+}
+
+// Whether a call whose head is name, which isn't a local, could be a macro
+// call: name is a macro, or will be one, or isn't defined yet. Sets value
+// to what name is bound to now, if anything.
+static bool mightBeMacro(const String& name, const Analysis& analysis,
+                         malValuePtr& value)
+{
+    if (analysis.macros.count(name) != 0) {
+        return true;
+    }
+    if (malEnvPtr env = analysis.env->find(name)) {
+        value = env->get(name);
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+        return lambda && lambda->isMacro();
+    }
+    // Possibly a macro which will be defined by the time this runs.
+    return analysis.defined.count(name) == 0;
+}
+
+static bool mightRebind(malValuePtr ast, const Scope& scope,
+                        const Analysis& analysis);
+
+static bool mightRebindItems(const malSequence* seq, int from,
+                             const Scope& scope, const Analysis& analysis)
+{
+    for (int i = from; i < seq->count(); i++) {
+        if (mightRebind(seq->item(i), scope, analysis)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Only what's unquoted in a quasiquote template is evaluated.
+static bool mightRebindQuoted(malValuePtr ast, const Scope& scope,
+                              const Analysis& analysis)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, ast);
+    if (!seq) {
+        return false;
+    }
+    const malSymbol* head = symbolAt(seq, 0);
+    if (head && (seq->count() == 2) && DYNAMIC_CAST(malList, ast) &&
+        ((head->value() == "unquote") ||
+         (head->value() == "splice-unquote"))) {
+        return mightRebind(seq->item(1), scope, analysis);
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        if (mightRebindQuoted(*it, scope, analysis)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether evaluating ast in a frame could def! a name in that frame by way
+// of a macro call, which can't be seen into until it's expanded. fn*, let*
+// and catch* make frames of their own, so what's inside them is left for
+// when they're analyzed.
+static bool mightRebind(malValuePtr ast, const Scope& scope,
+                        const Analysis& analysis)
+{
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        return !hash->isLiteral() &&
+            mightRebindItems(STATIC_CAST(malSequence, hash->values()), 0,
+                             scope, analysis);
+    }
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        return mightRebindItems(vec, 0, scope, analysis);
+    }
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return false;
+    }
+    const malSymbol* head = symbolAt(list, 0);
+    if (!head) {
+        return mightRebindItems(list, 0, scope, analysis);
+    }
+
+    const String& special = head->value();
+    if ((special == "quote") || (special == "macroexpand") ||
+        (special == "fn*") || (special == "let*")) {
+        return false;
+    }
+    if (special == "quasiquote") {
+        return (list->count() > 1) &&
+               mightRebindQuoted(list->item(1), scope, analysis);
+    }
+    if ((special == "def!") || (special == "defmacro!")) {
+        return mightRebindItems(list, 2, scope, analysis);
+    }
+    if ((special == "do") || (special == "if")) {
+        return mightRebindItems(list, 1, scope, analysis);
+    }
+    if (special == "try*") {
+        return (list->count() > 1) &&
+               mightRebind(list->item(1), scope, analysis);
+    }
+
+    malValuePtr value;
+    if ((scope.locals.count(special) == 0) &&
+        mightBeMacro(special, analysis, value)) {
+        return true;
+    }
+    return mightRebindItems(list, 1, scope, analysis);
+}
+
+// Returns a copy of seq with the items from `from` onwards analyzed, or seq
+// itself if none of them changed.
+static malValuePtr analyzeItems(malValuePtr ast, int from,
+                                const Scope& scope, Analysis& analysis)
+{
+    const malSequence* seq = STATIC_CAST(malSequence, ast);
+    malValueVec* items = NULL;
+    for (int i = from; i < seq->count(); i++) {
+        malValuePtr item = analyze(seq->item(i), scope, analysis);
+        if (!items && (item != seq->item(i))) {
+            items = new malValueVec(seq->begin(), seq->end());
+        }
+        if (items) {
+            (*items)[i] = item;
+        }
+    }
+    if (!items) {
+        return ast;
+    }
+    return DYNAMIC_CAST(malList, ast) ? mal::list(items) : mal::vector(items);
+}
+
+// Analyzes the values in a let*'s bindings, with the names from each one
+// on pending while it's evaluated.
+static malValuePtr analyzeBindings(malValuePtr ast, const Scope& scope,
+                                   Analysis& analysis)
+{
+    const malSequence* seq = STATIC_CAST(malSequence, ast);
+    malValueVec* items = NULL;
+    for (int i = 1; i < seq->count(); i += 2) {
+        Scope inner(scope);
+        for (int j = i - 1; j < seq->count(); j += 2) {
+            if (const malSymbol* name = symbolAt(seq, j)) {
+                inner.pending.insert(name->value());
+            }
+        }
+        malValuePtr item = analyze(seq->item(i), inner, analysis);
+        if (!items && (item != seq->item(i))) {
+            items = new malValueVec(seq->begin(), seq->end());
+        }
+        if (items) {
+            (*items)[i] = item;
+        }
+    }
+    if (!items) {
+        return ast;
+    }
+    return DYNAMIC_CAST(malList, ast) ? mal::list(items) : mal::vector(items);
+}
+
+static void addParams(Scope& scope, malValuePtr params)
+{
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, params)) {
+        for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+            if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, *it)) {
+                scope.locals.insert(sym->value());
+                scope.pending.erase(sym->value());
+            }
+        }
+    }
+}
+
+// The names in an fn*'s parameter list, if they're all symbols.
+static bool paramsOf(malValuePtr params, StringVec& names)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, params);
+    if (!seq) {
+        return false;
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        const malSymbol* sym = DYNAMIC_CAST(malSymbol, *it);
+        if (!sym) {
+            return false;
+        }
+        names.push_back(sym->value());
+    }
+    return true;
+}
+
+static bool collectFree(malValuePtr ast, const Names& bound,
+                        const Scope& scope, const Analysis& analysis,
+                        Names& free);
+
+static bool collectFreeItems(const malSequence* seq, int from,
+                             const Names& bound, const Scope& scope,
+                             const Analysis& analysis, Names& free)
+{
+    for (int i = from; i < seq->count(); i++) {
+        if (!collectFree(seq->item(i), bound, scope, analysis, free)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Only what's unquoted in a quasiquote template is evaluated.
+static bool collectFreeQuoted(malValuePtr ast, const Names& bound,
+                              const Scope& scope, const Analysis& analysis,
+                              Names& free)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, ast);
+    if (!seq) {
+        return true;
+    }
+    const malSymbol* head = symbolAt(seq, 0);
+    if (head && (seq->count() == 2) && DYNAMIC_CAST(malList, ast) &&
+        ((head->value() == "unquote") ||
+         (head->value() == "splice-unquote"))) {
+        return collectFree(seq->item(1), bound, scope, analysis, free);
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        if (!collectFreeQuoted(*it, bound, scope, analysis, free)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds the names which ast refers to, and doesn't bind itself, to free.
+// Returns false if they can't all be seen without expanding a macro, and
+// if ast uses eval.
+static bool collectFree(malValuePtr ast, const Names& bound,
+                        const Scope& scope, const Analysis& analysis,
+                        Names& free)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, ast)) {
+        if (bound.count(sym->value()) == 0) {
+            if (sym->value() == "eval") {
+                return false;
+            }
+            free.insert(sym->value());
+        }
+        return true;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        return hash->isLiteral() ||
+            collectFreeItems(STATIC_CAST(malSequence, hash->values()), 0,
+                             bound, scope, analysis, free);
+    }
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        return collectFreeItems(vec, 0, bound, scope, analysis, free);
+    }
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return true;
+    }
+    const malSymbol* head = symbolAt(list, 0);
+    if (!head) {
+        return collectFreeItems(list, 0, bound, scope, analysis, free);
+    }
+
+    const String& special = head->value();
+    int count = list->count();
+    if (special == "quote") {
+        return true;
+    }
+    if ((special == "quasiquote") && (count == 2)) {
+        return collectFreeQuoted(list->item(1), bound, scope, analysis, free);
+    }
+    if ((special == "def!") && (count == 3)) {
+        return collectFree(list->item(2), bound, scope, analysis, free);
+    }
+    if ((special == "do") || (special == "if")) {
+        return collectFreeItems(list, 1, bound, scope, analysis, free);
+    }
+    if ((special == "fn*") && (count == 3)) {
+        Names inner(bound);
+        StringVec params;
+        if (!paramsOf(list->item(1), params)) {
+            return false;
+        }
+        inner.insert(params.begin(), params.end());
+        return collectFree(list->item(2), inner, scope, analysis, free);
+    }
+    if ((special == "let*") && (count == 3)) {
+        const malSequence* bindings = DYNAMIC_CAST(malSequence, list->item(1));
+        if (!bindings) {
+            return false;
+        }
+        Names inner(bound);
+        for (int i = 0; i + 1 < bindings->count(); i += 2) {
+            if (!collectFree(bindings->item(i + 1), inner, scope, analysis,
+                             free)) {
+                return false;
+            }
+            if (const malSymbol* name = symbolAt(bindings, i)) {
+                inner.insert(name->value());
+            }
+        }
+        return collectFree(list->item(2), inner, scope, analysis, free);
+    }
+    if ((special == "try*") && (count == 3)) {
+        const malList* catchForm = DYNAMIC_CAST(malList, list->item(2));
+        const malSymbol* catchHead = catchForm ? symbolAt(catchForm, 0) : NULL;
+        const malSymbol* exception = catchForm ? symbolAt(catchForm, 1) : NULL;
+        if (!catchHead || (catchHead->value() != "catch*") || !exception ||
+            (catchForm->count() != 3)) {
+            return false;
+        }
+        Names inner(bound);
+        inner.insert(exception->value());
+        return collectFree(list->item(1), bound, scope, analysis, free) &&
+               collectFree(catchForm->item(2), inner, scope, analysis, free);
+    }
+    if ((special == "def!") || (special == "defmacro!") ||
+        (special == "fn*") || (special == "let*") ||
+        (special == "macroexpand") || (special == "quasiquote") ||
+        (special == "try*")) {
+        return false;
+    }
+
+    malValuePtr value;
+    if ((bound.count(special) == 0) && (scope.locals.count(special) == 0) &&
+        mightBeMacro(special, analysis, value)) {
+        return false;
+    }
+    return collectFreeItems(list, 0, bound, scope, analysis, free);
+}
+
+// The argument's value if it's an integer known ahead of time, or NULL.
+static malValuePtr integerArg(malValuePtr arg)
+{
+    if (const malFolded* folded = DYNAMIC_CAST(malFolded, arg)) {
+        arg = folded->value();
+    }
+    return DYNAMIC_CAST(malInteger, arg) ? arg : malValuePtr();
+}
+
+static malValuePtr fold(malValuePtr call, const malBuiltIn* builtIn)
+{
+    const malList* list = STATIC_CAST(malList, call);
+    malValuePtr lhs = integerArg(list->item(1));
+    malValuePtr rhs = integerArg(list->item(2));
+    if (!lhs || !rhs) {
+        return call;
+    }
+    try {
+        return mal::folded(call, builtIn->applyInline(lhs, rhs));
+    }
+    catch (String&) {
+        // Leave the error to be raised if the call is ever made.
+        return call;
+    }
+}
+
+// (get m :k) and (assoc m :k v), for records.
+static malValuePtr fieldSite(malValuePtr call, const malBuiltIn* builtIn)
+{
+    const malList* list = STATIC_CAST(malList, call);
+    const String name = builtIn->name();
+    bool isGet = (name == "get") && (list->count() == 3);
+    bool isAssoc = (name == "assoc") && (list->count() == 4);
+    if ((!isGet && !isAssoc) || !DYNAMIC_CAST(malKeyword, list->item(2))) {
+        return call;
+    }
+    return mal::fieldSite(call, list->item(1), list->item(2),
+                          isAssoc ? list->item(3) : malValuePtr());
+}
+
+// Compiles a quasiquote template to what quasiquote() in stepA_mal.cpp
+// would expand it to, less the calls of cons and concat: the value itself,
+// if nothing in it is unquoted, or else a form which builds it.
+static malValuePtr compileTemplate(malValuePtr ast, bool& isConstant,
+                                   const Scope& scope, Analysis& analysis)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, ast);
+    isConstant = true;
+    if (!seq || seq->isEmpty()) {
+        return ast;
+    }
+    const malSymbol* head = symbolAt(seq, 0);
+    if (head && (head->value() == "unquote")) {
+        checkArgsIs("unquote", 1, seq->count() - 1);
+        isConstant = false;
+        return analyze(seq->item(1), scope, analysis);
+    }
+
+    malTemplate::Parts parts;
+    bool isAllConstant = true;
+    for (int i = 0; i < seq->count(); i++) {
+        const malSymbol* sym = symbolAt(seq, i);
+        if ((i > 0) && sym && (sym->value() == "unquote")) {
+            // (a unquote b) is (a . ~b), so b's items are the rest.
+            checkArgsIs("unquote", 1, seq->count() - i - 1);
+            parts.push_back(malTemplate::Part(malTemplate::Splice,
+                analyze(seq->item(i + 1), scope, analysis)));
+            isAllConstant = false;
+            break;
+        }
+        const malSequence* inner = DYNAMIC_CAST(malSequence, seq->item(i));
+        const malSymbol* innerHead = inner ? symbolAt(inner, 0) : NULL;
+        if (innerHead && (innerHead->value() == "splice-unquote")) {
+            checkArgsIs("splice-unquote", 1, inner->count() - 1);
+            parts.push_back(malTemplate::Part(malTemplate::Splice,
+                analyze(inner->item(1), scope, analysis)));
+            isAllConstant = false;
+            continue;
+        }
+        bool isItemConstant;
+        malValuePtr value = compileTemplate(seq->item(i), isItemConstant,
+                                            scope, analysis);
+        parts.push_back(malTemplate::Part(
+            isItemConstant ? malTemplate::Constant : malTemplate::Unquote,
+            value));
+        isAllConstant = isAllConstant && isItemConstant;
+    }
+
+    if (isAllConstant) {
+        malValueVec* items = new malValueVec;
+        for (auto it = parts.begin(), end = parts.end(); it != end; ++it) {
+            items->push_back(it->value);
+        }
+        return mal::list(items);
+    }
+    isConstant = false;
+    return mal::listTemplate(mal::list(mal::symbol("quasiquote"), ast),
+                             parts);
+}
+
+static malValuePtr analyzeQuasiquote(malValuePtr ast, const Scope& scope,
+                                     Analysis& analysis)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    try {
+        bool isConstant;
+        malValuePtr form = compileTemplate(list->item(1), isConstant,
+                                           scope, analysis);
+        return isConstant ? mal::list(mal::symbol("quote"), form) : form;
+    }
+    catch (String&) {
+        // Leave the error to be raised if the form is ever evaluated.
+        return ast;
+    }
+}
+
+// An fn* inside a function, let* or catch* becomes a malFnForm if all the
+// free names of its body can be seen, and none of the locals among them
+// can be bound after the lambda is made: by a def! inside the form, by a
+// macro call in one of the frames around it, or further on in a let* which
+// it's part of.
+static malValuePtr analyzeFn(malValuePtr ast, const Scope& scope,
+                             Analysis& analysis)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    StringVec params;
+    StringVec captures;
+    bool isClosed = (scope.frames > 0) && !scope.mayRebind &&
+                    paramsOf(list->item(1), params);
+    if (isClosed) {
+        Names bound(params.begin(), params.end());
+        Names free;
+        isClosed = collectFree(list->item(2), bound, scope, analysis, free);
+        for (auto it = free.begin(), end = free.end();
+             isClosed && (it != end); ++it) {
+            if ((analysis.nested.count(*it) != 0) ||
+                (scope.pending.count(*it) != 0)) {
+                isClosed = false;
+            }
+            else if (scope.locals.count(*it) != 0) {
+                captures.push_back(*it);
+            }
+        }
+    }
+
+    // The body's frame is outside the one its captures are copied into,
+    // if there is one, and the globals are outside that.
+    Scope inner(scope);
+    addParams(inner, list->item(1));
+    if (isClosed) {
+        inner.frames = captures.empty() ? 1 : 2;
+        inner.mayRebind = false;
+    }
+    else {
+        inner.frames++;
+    }
+    inner.mayRebind = inner.mayRebind ||
+                      mightRebind(list->item(2), inner, analysis);
+    malValuePtr fn = analyzeItems(ast, 2, inner, analysis);
+    if (!isClosed) {
+        return fn;
+    }
+    return mal::fnForm(fn, params, captures, scope.frames);
+}
+
+static malValuePtr analyzeCall(malValuePtr ast, const malSymbol* head,
+                               const Scope& scope, Analysis& analysis)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    const String& name = head->value();
+
+    if (scope.locals.count(name) != 0) {
+        return analyzeItems(ast, 1, scope, analysis);
+    }
+    malValuePtr value;
+    if (mightBeMacro(name, analysis, value)) {
+        return ast;
+    }
+
+    malValuePtr call = analyzeItems(ast, 1, scope, analysis);
+    if (analysis.defined.count(name) != 0) {
+        return call;
+    }
+    if (DYNAMIC_CAST(malProtocolFn, value) && (list->count() > 1)) {
+        return mal::dispatchSite(call, value);
+    }
+    const malBuiltIn* builtIn = DYNAMIC_CAST(malBuiltIn, value);
+    if (!builtIn) {
+        return call;
+    }
+    if (builtIn->inlineOp() != malBuiltIn::NotInline) {
+        return (list->count() == 3) ? fold(call, builtIn) : call;
+    }
+    return fieldSite(call, builtIn);
+}
+
+static malValuePtr analyze(malValuePtr ast, const Scope& scope,
+                           Analysis& analysis)
+{
+    if (DYNAMIC_CAST(malVector, ast)) {
+        return analyzeItems(ast, 0, scope, analysis);
+    }
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return ast;
+    }
+    const malSymbol* head = symbolAt(list, 0);
+    if (!head) {
+        return analyzeItems(ast, 0, scope, analysis);
+    }
+
+    const String& special = head->value();
+    if ((special == "quote") || (special == "macroexpand")) {
+        return ast;
+    }
+    if ((special == "quasiquote") && (list->count() == 2)) {
+        return analyzeQuasiquote(ast, scope, analysis);
+    }
+    if ((special == "def!") || (special == "defmacro!")) {
+        return analyzeItems(ast, 2, scope, analysis);
+    }
+    if ((special == "do") || (special == "if")) {
+        return analyzeItems(ast, 1, scope, analysis);
+    }
+    if ((special == "fn*") && (list->count() == 3)) {
+        return analyzeFn(ast, scope, analysis);
+    }
+    if ((special == "let*") && (list->count() == 3)) {
+        // Every name bound here shadows its builtin for the whole form,
+        // which is more than it strictly needs to but errs on the safe
+        // side.
+        Scope inner(scope);
+        inner.frames++;
+        malValuePtr bindings = list->item(1);
+        const malSequence* seq = DYNAMIC_CAST(malSequence, bindings);
+        for (int i = 0; seq && (i < seq->count()); i += 2) {
+            if (const malSymbol* name = symbolAt(seq, i)) {
+                inner.locals.insert(name->value());
+                inner.pending.erase(name->value());
+            }
+        }
+        for (int i = 1; seq && (i < seq->count()); i += 2) {
+            inner.mayRebind = inner.mayRebind ||
+                              mightRebind(seq->item(i), inner, analysis);
+        }
+        inner.mayRebind = inner.mayRebind ||
+                          mightRebind(list->item(2), inner, analysis);
+        if (seq) {
+            bindings = analyzeBindings(bindings, inner, analysis);
+        }
+        malValuePtr body = analyze(list->item(2), inner, analysis);
+        if ((bindings == list->item(1)) && (body == list->item(2))) {
+            return ast;
+        }
+        return mal::list(list->item(0), bindings, body);
+    }
+    if ((special == "try*") && (list->count() == 3)) {
+        malValuePtr body = analyze(list->item(1), scope, analysis);
+        malValuePtr handler = list->item(2);
+        const malList* catchForm = DYNAMIC_CAST(malList, handler);
+        const malSymbol* catchHead = catchForm ? symbolAt(catchForm, 0) : NULL;
+        if (catchHead && (catchHead->value() == "catch*") &&
+            (catchForm->count() == 3)) {
+            Scope inner(scope);
+            addParams(inner, mal::list(catchForm->item(1)));
+            inner.frames++;
+            inner.mayRebind = inner.mayRebind ||
+                mightRebind(catchForm->item(2), inner, analysis);
+            handler = analyzeItems(handler, 2, inner, analysis);
+        }
+        if ((body == list->item(1)) && (handler == list->item(2))) {
+            return ast;
+        }
+        return mal::list(list->item(0), body, handler);
+    }
+    return analyzeCall(ast, head, scope, analysis);
+}
+
+malValuePtr analyze(malValuePtr ast, malEnvPtr env)
+{
+    if (!env) {
+        Interpreter* interpreter = Interpreter::current();
+        if (!interpreter) {
+            return ast;
+        }
+        env = interpreter->env();
+    }
+    Analysis analysis;
+    analysis.env = env;
+    collectDefinitions(ast, analysis, false);
+    return analyze(ast, Scope(), analysis);
+}
+
+malValuePtr analyzeBody(const StringVec& params, malValuePtr body,
+                        malEnvPtr env)
+{
+    Analysis analysis;
+    analysis.env = env;
+    collectDefinitions(body, analysis, true);
+    Scope scope;
+    scope.locals.insert(params.begin(), params.end());
+    scope.frames = 1;
+    scope.mayRebind = mightRebind(body, scope, analysis);
+    return analyze(body, scope, analysis);
+}
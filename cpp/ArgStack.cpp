@@ -0,0 +1,56 @@
+#include "ArgStack.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <memory>
+
+namespace {
+
+struct Stack {
+    // Enough for most programs never to need a second chunk.
+    static const size_t ChunkSize = 4096;
+
+    Stack() : chunk(0), top(0) {
+        chunks.emplace_back(new malValueVec(ChunkSize));
+    }
+
+    std::vector<std::unique_ptr<malValueVec> > chunks;
+    size_t chunk; // the one in use
+    size_t top;   // its first free slot
+};
+
+}
+
+static thread_local Stack s_stack;
+
+ArgStack::Frame::Frame(int count)
+{
+    Stack& stack = s_stack;
+    m_previousChunk = stack.chunk;
+    m_previousTop = stack.top;
+
+    if (stack.top + count > stack.chunks[stack.chunk]->size()) {
+        // Move on to the next chunk. Anything in it is free, so it can be
+        // replaced if it's too small.
+        size_t size = std::max(Stack::ChunkSize, size_t(count));
+        stack.chunk++;
+        stack.top = 0;
+        if (stack.chunk == stack.chunks.size()) {
+            stack.chunks.emplace_back(new malValueVec(size));
+        }
+        else if (stack.chunks[stack.chunk]->size() < size) {
+            stack.chunks[stack.chunk].reset(new malValueVec(size));
+        }
+    }
+
+    m_begin = stack.chunks[stack.chunk]->data() + stack.top;
+    m_end = m_begin + count;
+    stack.top += count;
+}
+
+ArgStack::Frame::~Frame()
+{
+    std::fill(m_begin, m_end, malValuePtr());
+    s_stack.chunk = m_previousChunk;
+    s_stack.top = m_previousTop;
+}
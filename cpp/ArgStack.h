@@ -0,0 +1,37 @@
+#ifndef INCLUDE_ARGSTACK_H
+#define INCLUDE_ARGSTACK_H
+
+#include "MAL.h"
+
+// The arguments of calls in progress on this thread. Rather than each call
+// gathering its arguments in a vector of its own, it claims a run of slots
+// here and gives them back when the callee returns, so making a call
+// doesn't allocate. The slots live in chunks which never move, so the
+// iterators builtins are given stay good for the whole call.
+class ArgStack {
+public:
+    // Claims count slots for as long as it lives. Frames are given back in
+    // the reverse order to how they were claimed, which their scopes see
+    // to, even when an exception unwinds them.
+    class Frame {
+    public:
+        Frame(int count);
+        ~Frame();
+
+        malValuePtr& operator [] (int index) { return m_begin[index]; }
+
+        malValueIter begin() const { return m_begin; }
+        malValueIter end()   const { return m_end; }
+
+    private:
+        Frame(const Frame&); // no copy ctor
+        Frame& operator = (const Frame&); // no assignments
+
+        malValueIter m_begin;
+        malValueIter m_end;
+        size_t       m_previousChunk;
+        size_t       m_previousTop;
+    };
+};
+
+#endif // INCLUDE_ARGSTACK_H
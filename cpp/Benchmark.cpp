@@ -0,0 +1,234 @@
+#include "MAL.h"
+
+#include "Environment.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string.h>
+
+// Micro-benchmarks for the interpreter core. This links against libmal.a
+// and the stepA evaluator (with its main renamed), and times the hot
+// paths directly rather than through a mal script.
+//
+//  Usage: malbench [--reps N] [--filter TEXT] [--json FILE]
+
+extern String PRINT(malValuePtr ast);
+
+typedef std::function<void (int iterations)> BenchFunc;
+
+struct Benchmark {
+    String    name;
+    int       iterations;
+    BenchFunc func;
+};
+
+struct Result {
+    String name;
+    int    iterations;
+    int    reps;
+    double minNs;
+    double medianNs;
+};
+
+// Results are folded into this so the optimiser can't drop the work.
+static volatile int64_t s_sink;
+
+static const char* s_readSource =
+    "(def! fib (fn* (N) (if (= N 0) 1 (if (= N 1) 1 "
+    "(+ (fib (- N 1)) (fib (- N 2)))))))";
+
+static const char* s_printSource =
+    "(1 2 3 \"four\" :five [6 7 8 [9 10]] {\"a\" 1 :b (2 3)} nil true)";
+
+static Result runBenchmark(const Benchmark& bench, int reps)
+{
+    using namespace std::chrono;
+
+    // One untimed pass to warm caches and the allocator.
+    bench.func(bench.iterations);
+
+    std::vector<double> samples;
+    for (int i = 0; i < reps; i++) {
+        auto start = steady_clock::now();
+        bench.func(bench.iterations);
+        auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start);
+        samples.push_back(double(elapsed.count()) / bench.iterations);
+    }
+    std::sort(samples.begin(), samples.end());
+
+    Result result;
+    result.name       = bench.name;
+    result.iterations = bench.iterations;
+    result.reps       = reps;
+    result.minNs      = samples.front();
+    result.medianNs   = samples[samples.size() / 2];
+    return result;
+}
+
+static malEnvPtr makeEnvChain(malEnvPtr root, int depth)
+{
+    malEnvPtr env = root;
+    for (int i = 0; i < depth; i++) {
+        env = new malEnv(env);
+        for (int j = 0; j < 4; j++) {
+            env->set(STRF("local%d", j), mal::integer(j));
+        }
+    }
+    return env;
+}
+
+static void addEnvBenchmarks(std::vector<Benchmark>& benchmarks,
+                             malEnvPtr root)
+{
+    static const int depths[] = { 1, 4, 16 };
+    for (int depth : depths) {
+        malEnvPtr env = makeEnvChain(root, depth);
+        benchmarks.push_back({ STRF("env-get/depth-%d", depth), 1000000,
+            [env](int n) {
+                for (int i = 0; i < n; i++) {
+                    s_sink += env->get("+").ptr() != NULL;
+                }
+            }
+        });
+    }
+}
+
+static std::vector<Benchmark> makeBenchmarks(malEnvPtr env)
+{
+    std::vector<Benchmark> benchmarks;
+
+    benchmarks.push_back({ "read-str", 20000, [](int n) {
+        String source(s_readSource);
+        for (int i = 0; i < n; i++) {
+            s_sink += readStr(source).ptr() != NULL;
+        }
+    }});
+
+    malValuePtr printForm = readStr(s_printSource);
+    benchmarks.push_back({ "print", 100000, [printForm](int n) {
+        for (int i = 0; i < n; i++) {
+            s_sink += PRINT(printForm).length();
+        }
+    }});
+
+    addEnvBenchmarks(benchmarks, env);
+
+    malValuePtr plus = env->get("+");
+    benchmarks.push_back({ "apply/builtin", 1000000, [plus](int n) {
+        malValueVec args(2);
+        args[0] = mal::integer(1);
+        args[1] = mal::integer(2);
+        for (int i = 0; i < n; i++) {
+            s_sink += APPLY(plus, beginOf(args), endOf(args)).ptr() != NULL;
+        }
+    }});
+
+    malValuePtr lambda = EVAL(readStr("(fn* (a b) (+ a b))"), env);
+    benchmarks.push_back({ "apply/lambda", 500000, [lambda](int n) {
+        malValueVec args(2);
+        args[0] = mal::integer(1);
+        args[1] = mal::integer(2);
+        for (int i = 0; i < n; i++) {
+            s_sink += APPLY(lambda, beginOf(args), endOf(args)).ptr() != NULL;
+        }
+    }});
+
+    benchmarks.push_back({ "integer-alloc", 2000000, [](int n) {
+        for (int i = 0; i < n; i++) {
+            s_sink += mal::integer(i).ptr() != NULL;
+        }
+    }});
+
+    malValueVec pairs;
+    for (int i = 0; i < 16; i++) {
+        pairs.push_back(mal::keyword(STRF(":key%d", i)));
+        pairs.push_back(mal::integer(i));
+    }
+    malValuePtr hash = mal::hash(beginOf(pairs), endOf(pairs), true);
+
+    benchmarks.push_back({ "hash/assoc", 200000, [hash](int n) {
+        malValueVec kv(2);
+        kv[0] = mal::keyword(":key7");
+        kv[1] = mal::integer(42);
+        const malHash* h = STATIC_CAST(malHash, hash);
+        for (int i = 0; i < n; i++) {
+            s_sink += h->assoc(beginOf(kv), endOf(kv)).ptr() != NULL;
+        }
+    }});
+
+    benchmarks.push_back({ "hash/get", 1000000, [hash](int n) {
+        malValuePtr key = mal::keyword(":key7");
+        const malHash* h = STATIC_CAST(malHash, hash);
+        for (int i = 0; i < n; i++) {
+            s_sink += h->get(key).ptr() != NULL;
+        }
+    }});
+
+    return benchmarks;
+}
+
+static String toJson(const std::vector<Result>& results)
+{
+    String out = "{\n  \"unit\": \"ns/op\",\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        out += STRF("    {\"name\": %s, \"iterations\": %d, \"reps\": %d, "
+                    "\"min\": %.2f, \"median\": %.2f}%s\n",
+                    escape(r.name).c_str(), r.iterations, r.reps,
+                    r.minNs, r.medianNs,
+                    i + 1 < results.size() ? "," : "");
+    }
+    return out + "  ]\n}\n";
+}
+
+int main(int argc, char* argv[])
+{
+    int reps = 5;
+    String filter;
+    String jsonFile;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--reps") == 0) && (i + 1 < argc)) {
+            reps = std::max(1, atoi(argv[++i]));
+        }
+        else if ((strcmp(argv[i], "--filter") == 0) && (i + 1 < argc)) {
+            filter = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+            jsonFile = argv[++i];
+        }
+        else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--reps N] [--filter TEXT] [--json FILE]\n";
+            return 1;
+        }
+    }
+
+    malEnvPtr env(new malEnv);
+    installCore(env);
+
+    std::vector<Result> results;
+    for (auto& bench : makeBenchmarks(env)) {
+        if (bench.name.find(filter) == String::npos) {
+            continue;
+        }
+        Result r = runBenchmark(bench, reps);
+        std::cout << STRF("%-24s %10.1f ns/op  (median %.1f, %d x %d)\n",
+                          r.name.c_str(), r.minNs, r.medianNs,
+                          r.reps, r.iterations);
+        results.push_back(r);
+    }
+
+    if (!jsonFile.empty()) {
+        std::ofstream out(jsonFile.c_str());
+        if (out.fail()) {
+            std::cerr << "Cannot open " << jsonFile << "\n";
+            return 1;
+        }
+        out << toJson(results);
+    }
+    return 0;
+}
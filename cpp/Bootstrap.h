@@ -0,0 +1,10 @@
+#ifndef INCLUDE_BOOTSTRAP_H
+#define INCLUDE_BOOTSTRAP_H
+
+#include "MAL.h"
+
+// Defined in Bootstrap.cpp, which genbootstrap generates from prelude.mal
+// (and optionally core.mal) at build time.
+extern void installBootstrap(malEnvPtr env);
+
+#endif // INCLUDE_BOOTSTRAP_H
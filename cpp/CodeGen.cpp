@@ -0,0 +1,77 @@
+#include "CodeGen.h"
+#include "Types.h"
+
+String cppString(const String& in)
+{
+    String out = "\"";
+    for (char c : in) {
+        switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '"':  out += "\\\""; break;
+            case '\n': out += "\\n";  break;
+            case '?':  out += "\\?";  break; // no accidental trigraphs
+            default:
+                if ((unsigned char)c < ' ') {
+                    out += STRF("\\%03o", (unsigned char)c);
+                }
+                else {
+                    out += c;
+                }
+                break;
+        }
+    }
+    return out + "\"";
+}
+
+static String items(const malSequence* seq, bool& usesHash)
+{
+    String out = "new malValueVec({ ";
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        out += cppConstruct(*it, usesHash) + ", ";
+    }
+    return out + "})";
+}
+
+String cppConstruct(malValuePtr value, bool& usesHash)
+{
+    if (value == mal::nilValue()) {
+        return "mal::nilValue()";
+    }
+    if (value == mal::trueValue()) {
+        return "mal::trueValue()";
+    }
+    if (value == mal::falseValue()) {
+        return "mal::falseValue()";
+    }
+    if (const malInteger* i = DYNAMIC_CAST(malInteger, value)) {
+        return STRF("mal::integer(%lldLL)", (long long)i->value());
+    }
+    if (const malString* s = DYNAMIC_CAST(malString, value)) {
+        return "mal::string(" + cppString(s->value()) + ")";
+    }
+    if (const malKeyword* k = DYNAMIC_CAST(malKeyword, value)) {
+        return "mal::keyword(" + cppString(k->value()) + ")";
+    }
+    if (const malSymbol* s = DYNAMIC_CAST(malSymbol, value)) {
+        return "mal::symbol(" + cppString(s->value()) + ")";
+    }
+    if (const malList* l = DYNAMIC_CAST(malList, value)) {
+        return "mal::list(" + items(l, usesHash) + ")";
+    }
+    if (const malVector* v = DYNAMIC_CAST(malVector, value)) {
+        return "mal::vector(" + items(v, usesHash) + ")";
+    }
+    if (const malHash* h = DYNAMIC_CAST(malHash, value)) {
+        malValuePtr keyList = h->keys(), valueList = h->values();
+        const malSequence* keys = STATIC_CAST(malSequence, keyList);
+        const malSequence* values = STATIC_CAST(malSequence, valueList);
+        usesHash = true;
+        String out = "hash({ ";
+        for (int i = 0; i < keys->count(); i++) {
+            out += cppConstruct(keys->item(i), usesHash) + ", ";
+            out += cppConstruct(values->item(i), usesHash) + ", ";
+        }
+        return out + "})";
+    }
+    MAL_FAIL("Can't generate %s", value->print(true).c_str());
+}
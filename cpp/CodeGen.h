@@ -0,0 +1,17 @@
+#ifndef INCLUDE_CODEGEN_H
+#define INCLUDE_CODEGEN_H
+
+#include "MAL.h"
+
+// Shared by the build-time tools, genbootstrap and malc, which write out
+// C++ that builds mal values directly rather than reading them at startup.
+
+// Returns in as a C++ string literal.
+String cppString(const String& in);
+
+// Returns a C++ expression which builds value. Hashes are built by calling
+// a hash(malValueVec) helper, which the generated file has to provide, so
+// usesHash is set whenever one is needed.
+String cppConstruct(malValuePtr value, bool& usesHash);
+
+#endif // INCLUDE_CODEGEN_H
@@ -0,0 +1,122 @@
+#include "Compiled.h"
+#include "ReadLine.h"
+
+#include <unordered_map>
+
+void checkArgCount(malValueIter argsBegin, malValueIter argsEnd,
+                   int count, bool hasRest)
+{
+    int got = argsEnd - argsBegin;
+    MAL_CHECK(got >= count, "Not enough parameters");
+    MAL_CHECK(hasRest || (got == count), "Too many parameters");
+}
+
+bool isMacro(const malValuePtr& value)
+{
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+    return lambda && lambda->isMacro();
+}
+
+const malValuePtr& GlobalRef::resolve(const malEnvPtr& env)
+{
+    // A global bound further out could yet be shadowed by a def! in env,
+    // so only env's own slots are kept.
+    m_env = env;
+    m_slot = env->find(m_name) == env ? env->lookup(m_name) : NULL;
+    m_value = m_slot ? *m_slot : env->get(m_name);
+    m_isMacro = ::isMacro(m_value);
+    return m_value;
+}
+
+malValuePtr interpret(malValuePtr ast, const malEnvPtr& env,
+                      const StringVec& names, malValueVec values)
+{
+    if (names.empty()) {
+        return EVAL(ast, env);
+    }
+    return EVAL(ast, new malEnv(env, names, beginOf(values), endOf(values)));
+}
+
+static void setArgv(Interpreter& interpreter, int argc, char* argv[])
+{
+    malValueVec* args = new malValueVec();
+    for (int i = 0; i < argc; i++) {
+        args->push_back(mal::string(argv[i]));
+    }
+    interpreter.set("*ARGV*", mal::list(args));
+}
+
+int runCompiledProgram(int argc, char* argv[],
+                       const CompiledForm* forms, int count)
+{
+    Interpreter interpreter;
+    Interpreter::Scope scope(&interpreter);
+    setArgv(interpreter, argc - 1, argv + 1);
+    try {
+        for (int i = 0; i < count; i++) {
+            forms[i].code(interpreter.env());
+        }
+        return 0;
+    }
+    catch (String& s) {
+        std::cerr << s << "\n";
+    }
+    catch (malEmptyInputException&) {
+        return 0;
+    }
+    catch (malValuePtr& o) {
+        std::cerr << o->print(true) << "\n";
+    };
+    return 1;
+}
+
+static ReadLine& readLine()
+{
+    static ReadLine s_readLine("~/.mal-history");
+    return s_readLine;
+}
+
+// As stepA_mal's REPL prints it.
+static String safeRun(CompiledForm::Code code, const String& input,
+                      Interpreter& interpreter)
+{
+    try {
+        if (!code) {
+            return interpreter.rep(input);
+        }
+        Interpreter::Scope scope(&interpreter);
+        return code(interpreter.env())->print(true);
+    }
+    catch (malEmptyInputException&) {
+        return String();
+    }
+    catch (String& s) {
+        return s;
+    };
+}
+
+int runCompiledRepl(int argc, char* argv[],
+                    const CompiledForm* forms, int count)
+{
+    std::unordered_map<String, CompiledForm::Code> compiled;
+    for (int i = 0; i < count; i++) {
+        compiled[forms[i].source] = forms[i].code;
+    }
+
+    String prompt = "user> ";
+    String input;
+    Interpreter interpreter;
+    interpreter.setInput([](const String& prompt, String& line) {
+        return readLine().get(prompt, line);
+    });
+    setArgv(interpreter, argc - 1, argv + 1);
+    interpreter.rep("(println (str \"Mal [\" *host-language* \"]\"))");
+    while (readLine().get(prompt, input)) {
+        auto it = compiled.find(input);
+        String out = safeRun(it != compiled.end() ? it->second : NULL,
+                             input, interpreter);
+        if (out.length() > 0)
+            std::cout << out << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef INCLUDE_COMPILED_H
+#define INCLUDE_COMPILED_H
+
+#include "MAL.h"
+
+#include "ArgStack.h"
+#include "Environment.h"
+#include "Interpreter.h"
+#include "Types.h"
+
+// Runtime support for the C++ which malc writes. A compiled program is a
+// table of top-level forms, each a function run in the globals of an
+// embedded Interpreter, which also evaluates whatever malc left alone:
+// macro calls, eval, load-file and the forms it doesn't compile.
+
+struct CompiledForm {
+    typedef malValuePtr (*Code)(const malEnvPtr& env);
+
+    const char* source;
+    Code        code;
+};
+
+// A hash as the reader builds it, for quoted literals.
+inline malValuePtr hash(malValueVec items)
+{
+    return mal::hash(beginOf(items), endOf(items), false);
+}
+
+// A hash literal whose values have been evaluated.
+inline malValuePtr evaluatedHash(malValueVec items)
+{
+    return mal::hash(beginOf(items), endOf(items), true);
+}
+
+// Fails as binding the parameters of an interpreted function would, if
+// the arguments don't fit count parameters (and a rest parameter).
+void checkArgCount(malValueIter argsBegin, malValueIter argsEnd,
+                   int count, bool hasRest);
+
+bool isMacro(const malValuePtr& value);
+
+// A global which compiled code calls. Each call site keeps one per thread,
+// which finds the global's slot in the env once and then reads it there,
+// as def! overwrites the slot in place, so redefinitions are still seen.
+// Whether the value is a macro is only worked out again when it changes.
+class GlobalRef {
+public:
+    GlobalRef(const char* name) : m_name(name), m_slot(NULL)
+    , m_isMacro(false) { }
+
+    const malValuePtr& get(const malEnvPtr& env) {
+        if (!m_slot || (env != m_env)) {
+            return resolve(env);
+        }
+        if (*m_slot != m_value) {
+            m_value = *m_slot;
+            m_isMacro = ::isMacro(m_value);
+        }
+        return m_value;
+    }
+
+    bool isMacro() const { return m_isMacro; }
+
+private:
+    const malValuePtr& resolve(const malEnvPtr& env);
+
+    const char*        m_name;
+    malEnvPtr          m_env;
+    const malValuePtr* m_slot; // NULL unless bound in m_env itself
+    malValuePtr        m_value;
+    bool               m_isMacro;
+};
+
+// Evaluates ast in a child of env which binds the compiled code's visible
+// locals.
+malValuePtr interpret(malValuePtr ast, const malEnvPtr& env,
+                      const StringVec& names, malValueVec values);
+
+// The main() of a compiled program: runs the forms in order, with *ARGV*
+// set from the command line.
+int runCompiledProgram(int argc, char* argv[],
+                       const CompiledForm* forms, int count);
+
+// The main() of a compiled REPL: reads lines as stepA_mal does, running the
+// compiled form for any line which is the source of one, and interpreting
+// the rest.
+int runCompiledRepl(int argc, char* argv[],
+                    const CompiledForm* forms, int count);
+
+#endif // INCLUDE_COMPILED_H
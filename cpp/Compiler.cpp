@@ -0,0 +1,831 @@
+#include "CodeGen.h"
+#include "Compiled.h"
+#include "MAL.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+
+// malc, an ahead-of-time compiler from mal to C++. Each top-level form
+// becomes a C++ function run in the globals of an embedded interpreter.
+// Locals live in C++ locals, closures copy in just the locals they use,
+// and a function's tail calls to itself become a loop, while its other
+// tail calls are handed back to malCompiledFn::apply to make. Globals are
+// found once per call site and read through their slots at runtime, so
+// that they can be redefined.
+//
+// Anything it can't compile is left to the interpreter: macro calls, with
+// the visible locals bound in an environment for them, and whole top-level
+// forms which define macros or def! anything other than a global.
+//
+//  Usage: malc FILE.mal > prog.cpp
+//         malc --repl FILE.mal... > repl.cpp
+//
+// The first compiles a program, which runs the forms in FILE.mal in order.
+// The second compiles a REPL, which runs the compiled code for any input
+// line that matches a line of the files, and interprets the rest. That's
+// how the tests/step*.mal suites run compiled code under runtest.py.
+
+struct Function;
+
+struct Scope {
+    Scope(Scope* outer, Function* fn) : outer(outer), fn(fn) { }
+
+    Scope*    outer;
+    Function* fn;   // NULL at the top level
+    std::vector<std::pair<String, String> > vars; // mal name, C++ name
+};
+
+struct Function {
+    Function(Scope* definedIn, const String& selfName)
+    : definedIn(definedIn), selfName(selfName), hasRest(false)
+    , usesEnv(false), loops(false) { }
+
+    Scope*    definedIn;
+    String    selfName;     // the global it's def!'d as, or ""
+    StringVec params;       // C++ names, the last one the rest if hasRest
+    bool      hasRest;
+    bool      usesEnv;
+    bool      loops;        // has a tail call to itself
+
+    StringVec captureNames; // mal names
+    StringVec captureVars;  // C++ names in this function
+    StringVec captureFrom;  // C++ names where the function is created
+};
+
+class Code {
+public:
+    Code(int indent = 1) : m_indent(indent) { }
+
+    void line(const String& text) {
+        m_text += String(m_indent * 4, ' ') + text + "\n";
+    }
+    void open(const String& text) { line(text + " {"); m_indent++; }
+    void close() { m_indent--; line("}"); }
+
+    const String& text() const { return m_text; }
+
+private:
+    String m_text;
+    int    m_indent;
+};
+
+class Compiler {
+public:
+    Compiler(Interpreter& interpreter) : m_interpreter(interpreter)
+    , m_nextId(0), m_compiledForms(0), m_interpretedCalls(0) { }
+
+    void addForm(malValuePtr form, const String& source);
+    void write(std::ostream& out, bool isRepl, const String& origin);
+    void report(std::ostream& out);
+
+private:
+    void compile(malValuePtr form, Scope* scope, Code& out,
+                 const String& target);
+    bool compileSpecial(const malList* list, Scope* scope, Code& out,
+                        const String& target);
+    void compileCall(malValuePtr form, const malList* list, Scope* scope,
+                     Code& out, const String& target);
+    void compileSelfCall(Function* fn, const String& args, int argCount,
+                         Code& out);
+    String compileFn(const malList* list, Scope* scope,
+                     const String& selfName);
+    String expr(malValuePtr form, Scope* scope, Code& out);
+
+    String constant(malValuePtr value);
+    String env(Scope* scope);
+    String interpretForm(malValuePtr form, Scope* scope);
+    bool isKnownMacro(const String& name);
+    String lookup(const String& name, Scope* scope);
+    String newName(const char* prefix, const String& malName = "");
+
+    Interpreter&      m_interpreter;
+    std::set<String>  m_macros;     // defined by the program so far
+    std::set<String>  m_defined;    // def!'d by the program so far
+    StringVec         m_constants;
+    String            m_functions;
+    StringVec         m_forms;      // source, C++ name
+    int               m_nextId;
+    int               m_compiledForms;
+    int               m_interpretedCalls;
+};
+
+static bool isSymbol(malValuePtr value, const char* name)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, value);
+    return sym && (sym->value() == name);
+}
+
+static const malSequence* isPair(malValuePtr obj)
+{
+    const malSequence* list = DYNAMIC_CAST(malSequence, obj);
+    return list && !list->isEmpty() ? list : NULL;
+}
+
+// The same rewrite as stepA_mal's, done once at compile time.
+static malValuePtr quasiquote(malValuePtr obj)
+{
+    const malSequence* seq = isPair(obj);
+    if (!seq) {
+        return mal::list(mal::symbol("quote"), obj);
+    }
+
+    if (isSymbol(seq->item(0), "unquote")) {
+        checkArgsIs("unquote", 1, seq->count() - 1);
+        return seq->item(1);
+    }
+
+    const malSequence* innerSeq = isPair(seq->item(0));
+    if (innerSeq && isSymbol(innerSeq->item(0), "splice-unquote")) {
+        checkArgsIs("splice-unquote", 1, innerSeq->count() - 1);
+        return mal::list(
+            mal::symbol("concat"),
+            innerSeq->item(1),
+            quasiquote(seq->rest())
+        );
+    }
+    else {
+        return mal::list(
+            mal::symbol("cons"),
+            quasiquote(seq->first()),
+            quasiquote(seq->rest())
+        );
+    }
+}
+
+// Whether any fn* within form mentions one of names. A let* binding can't
+// be a C++ local if a closure refers to it before it's bound.
+static bool closureMentions(malValuePtr form, const std::set<String>& names,
+                            bool inFn)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, form)) {
+        return inFn && names.count(sym->value());
+    }
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, form)) {
+        inFn |= DYNAMIC_CAST(malList, form) && isPair(form) &&
+                isSymbol(seq->item(0), "fn*");
+        for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+            if (closureMentions(*it, names, inFn)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        return closureMentions(hash->values(), names, inFn);
+    }
+    return false;
+}
+
+static const malSequence* checkSymbols(malValuePtr value)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, value);
+    MAL_CHECK(seq, "expected a sequence of symbols");
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        MAL_CHECK(DYNAMIC_CAST(malSymbol, *it), "expected a symbol");
+    }
+    return seq;
+}
+
+static String symbolName(malValuePtr value)
+{
+    return STATIC_CAST(malSymbol, value)->value();
+}
+
+static String join(const StringVec& items)
+{
+    String out;
+    for (auto& item : items) {
+        out += (out.empty() ? "" : ", ") + item;
+    }
+    return out;
+}
+
+static String quoteAll(const StringVec& items)
+{
+    StringVec quoted;
+    for (auto& item : items) {
+        quoted.push_back(cppString(item));
+    }
+    return join(quoted);
+}
+
+static void deliver(Code& out, const String& target, const String& value)
+{
+    out.line(target.empty() ? "return " + value + ";"
+                            : target + " = " + value + ";");
+}
+
+void Compiler::addForm(malValuePtr form, const String& source)
+{
+    String name = newName("form");
+    size_t constantCount = m_constants.size();
+    size_t functionsLength = m_functions.length();
+
+    Code body;
+    try {
+        Scope top(NULL, NULL);
+        compile(form, &top, body, "");
+        m_compiledForms++;
+    }
+    catch (String& reason) {
+        // Drop anything the abandoned attempt generated.
+        m_constants.resize(constantCount);
+        m_functions.resize(functionsLength);
+        body = Code();
+        body.line("// Interpreted: " + reason);
+        body.line("return EVAL(" + constant(form) + ", env);");
+    }
+
+    m_functions += "static malValuePtr " + name + "(const malEnvPtr& env)\n"
+                   "{\n" + body.text() + "}\n\n";
+    m_forms.push_back(source);
+    m_forms.push_back(name);
+}
+
+void Compiler::compile(malValuePtr form, Scope* scope, Code& out,
+                       const String& target)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (list && (list->count() > 0)) {
+        if (!compileSpecial(list, scope, out, target)) {
+            compileCall(form, list, scope, out, target);
+        }
+        return;
+    }
+
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, form)) {
+        String var = lookup(sym->value(), scope);
+        deliver(out, target, !var.empty() ? var :
+            env(scope) + "->get(" + cppString(sym->value()) + ")");
+        return;
+    }
+
+    if (const malVector* vec = DYNAMIC_CAST(malVector, form)) {
+        StringVec items;
+        for (auto it = vec->begin(), end = vec->end(); it != end; ++it) {
+            items.push_back(expr(*it, scope, out));
+        }
+        deliver(out, target,
+                "mal::vector(new malValueVec({ " + join(items) + " }))");
+        return;
+    }
+
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        malValuePtr keyList = hash->keys(), valueList = hash->values();
+        const malSequence* keys = STATIC_CAST(malSequence, keyList);
+        const malSequence* values = STATIC_CAST(malSequence, valueList);
+        StringVec items;
+        for (int i = 0; i < keys->count(); i++) {
+            items.push_back(constant(keys->item(i)));
+            items.push_back(expr(values->item(i), scope, out));
+        }
+        deliver(out, target, "evaluatedHash({ " + join(items) + " })");
+        return;
+    }
+
+    deliver(out, target, constant(form));
+}
+
+bool Compiler::compileSpecial(const malList* list, Scope* scope, Code& out,
+                              const String& target)
+{
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (!symbol) {
+        return false;
+    }
+    String special = symbol->value();
+    int argCount = list->count() - 1;
+
+    if (special == "def!") {
+        MAL_CHECK((argCount == 2) && DYNAMIC_CAST(malSymbol, list->item(1)),
+                  "malformed def!");
+        MAL_CHECK(!scope->outer && !scope->fn, "def! of a local");
+        String name = symbolName(list->item(1));
+        malValuePtr value = list->item(2);
+        const malList* fn = DYNAMIC_CAST(malList, value);
+        String result = fn && isPair(value) && isSymbol(fn->item(0), "fn*")
+                      ? compileFn(fn, scope, name)
+                      : expr(value, scope, out);
+        m_defined.insert(name);
+        m_macros.erase(name);
+        deliver(out, target,
+                "env->set(" + cppString(name) + ", " + result + ")");
+        return true;
+    }
+
+    if (special == "defmacro!") {
+        if ((argCount == 2) && DYNAMIC_CAST(malSymbol, list->item(1))) {
+            m_macros.insert(symbolName(list->item(1)));
+        }
+        MAL_FAIL("defines a macro");
+    }
+
+    if (special == "do") {
+        MAL_CHECK(argCount >= 1, "malformed do");
+        for (int i = 1; i < argCount; i++) {
+            expr(list->item(i), scope, out);
+        }
+        compile(list->item(argCount), scope, out, target);
+        return true;
+    }
+
+    if (special == "fn*") {
+        deliver(out, target, compileFn(list, scope, ""));
+        return true;
+    }
+
+    if (special == "if") {
+        MAL_CHECK((argCount == 2) || (argCount == 3), "malformed if");
+        String test = expr(list->item(1), scope, out);
+        out.open("if (" + test + "->isTrue())");
+        compile(list->item(2), scope, out, target);
+        out.close();
+        out.open("else");
+        if (argCount == 3) {
+            compile(list->item(3), scope, out, target);
+        }
+        else {
+            deliver(out, target, "mal::nilValue()");
+        }
+        out.close();
+        return true;
+    }
+
+    if (special == "let*") {
+        MAL_CHECK(argCount == 2, "malformed let*");
+        const malSequence* bindings = DYNAMIC_CAST(malSequence, list->item(1));
+        MAL_CHECK(bindings && (bindings->count() % 2 == 0), "malformed let*");
+        std::set<String> later;
+        for (int i = 0; i < bindings->count(); i += 2) {
+            MAL_CHECK(DYNAMIC_CAST(malSymbol, bindings->item(i)),
+                      "malformed let*");
+            later.insert(symbolName(bindings->item(i)));
+        }
+
+        Scope inner(scope, scope->fn);
+        for (int i = 0; i < bindings->count(); i += 2) {
+            MAL_CHECK(!closureMentions(bindings->item(i + 1), later, false),
+                      "let* binding used by a closure before it's bound");
+            String name = symbolName(bindings->item(i));
+            String value = expr(bindings->item(i + 1), &inner, out);
+            String var = newName("v", name);
+            out.line("malValuePtr " + var + " = " + value + ";");
+            inner.vars.push_back(std::make_pair(name, var));
+            later.erase(name);
+            for (int j = i + 2; j < bindings->count(); j += 2) {
+                later.insert(symbolName(bindings->item(j)));
+            }
+        }
+        compile(list->item(2), &inner, out, target);
+        return true;
+    }
+
+    if (special == "macroexpand") {
+        MAL_FAIL("macroexpand");
+    }
+
+    if (special == "quasiquote") {
+        MAL_CHECK(argCount == 1, "malformed quasiquote");
+        compile(quasiquote(list->item(1)), scope, out, target);
+        return true;
+    }
+
+    if (special == "quote") {
+        MAL_CHECK(argCount == 1, "malformed quote");
+        deliver(out, target, constant(list->item(1)));
+        return true;
+    }
+
+    if (special == "try*") {
+        const malList* catchBlock = argCount == 2
+                                  ? DYNAMIC_CAST(malList, list->item(2))
+                                  : NULL;
+        MAL_CHECK(catchBlock && (catchBlock->count() == 3) &&
+                  isSymbol(catchBlock->item(0), "catch*") &&
+                  DYNAMIC_CAST(malSymbol, catchBlock->item(1)),
+                  "malformed try*");
+
+        String result = newName("t");
+        String exception = newName("e");
+        out.line("malValuePtr " + result + ", " + exception + ";");
+        out.open("try");
+        compile(list->item(1), scope, out, result);
+        out.close();
+        out.open("catch (String& s)");
+        out.line(exception + " = mal::string(s);");
+        out.close();
+        out.open("catch (malEmptyInputException&)");
+        out.line(result + " = mal::nilValue();");
+        out.close();
+        out.open("catch (malValuePtr& o)");
+        out.line(exception + " = o;");
+        out.close();
+
+        out.open("if (" + exception + ")");
+        Scope inner(scope, scope->fn);
+        String name = symbolName(catchBlock->item(1));
+        String var = newName("v", name);
+        out.line("malValuePtr " + var + " = " + exception + ";");
+        inner.vars.push_back(std::make_pair(name, var));
+        compile(catchBlock->item(2), &inner, out, target);
+        out.close();
+        out.open("else");
+        deliver(out, target, result);
+        out.close();
+        return true;
+    }
+
+    return false;
+}
+
+void Compiler::compileCall(malValuePtr form, const malList* list,
+                           Scope* scope, Code& out, const String& target)
+{
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+    bool isGlobal = head && lookup(head->value(), scope).empty();
+    if (isGlobal && isKnownMacro(head->value())) {
+        m_interpretedCalls++;
+        deliver(out, target, interpretForm(form, scope));
+        return;
+    }
+
+    String op;
+    if (isGlobal) {
+        String ref = newName("g", head->value());
+        out.line("static thread_local GlobalRef " + ref + "(" +
+                 cppString(head->value()) + ");");
+        op = newName("t");
+        out.line("malValuePtr " + op + " = " + ref + ".get(" + env(scope) +
+                 ");");
+        // Only known at runtime to be a macro, if say load-file defined it.
+        out.open("if (" + ref + ".isMacro())");
+        deliver(out, target, interpretForm(form, scope));
+        out.close();
+        out.open("else");
+    }
+    else {
+        op = expr(list->item(0), scope, out);
+    }
+
+    // The arguments are evaluated straight into a frame on the ArgStack,
+    // as the interpreter does.
+    String args = newName("a");
+    int argCount = list->count() - 1;
+    out.line(STRF("ArgStack::Frame %s(%d);", args.c_str(), argCount));
+    for (int i = 0; i < argCount; i++) {
+        String slot = STRF("%s[%d]", args.c_str(), i);
+        malValuePtr arg = list->item(i + 1);
+        const malSymbol* sym = DYNAMIC_CAST(malSymbol, arg);
+        String var = sym ? lookup(sym->value(), scope) : String();
+        if (!var.empty()) {
+            out.line(slot + " = " + var + ";");
+        }
+        else {
+            compile(arg, scope, out, slot);
+        }
+    }
+
+    Function* fn = scope->fn;
+    bool isTail = target.empty() && fn;
+    if (isTail && isGlobal && (head->value() == fn->selfName)) {
+        out.open("if (" + op + ".ptr() == self)");
+        compileSelfCall(fn, args, argCount, out);
+        out.close();
+    }
+    String call = "(" + op + ", " + args + ".begin(), " + args + ".end())";
+    if (isTail) {
+        out.line("return malCompiledFn::tailCall" + call + ";");
+    }
+    else {
+        deliver(out, target, "APPLY" + call);
+    }
+
+    if (isGlobal) {
+        out.close();
+    }
+}
+
+// Rebinds the parameters from the call's frame and goes round the
+// function's loop again.
+void Compiler::compileSelfCall(Function* fn, const String& args,
+                               int argCount, Code& out)
+{
+    fn->loops = true;
+    int count = fn->params.size() - (fn->hasRest ? 1 : 0);
+    if (fn->hasRest || (argCount != count)) {
+        out.line(STRF("checkArgCount(%s.begin(), %s.end(), %d, %s);",
+                      args.c_str(), args.c_str(), count,
+                      fn->hasRest ? "true" : "false"));
+    }
+    for (int i = 0; i < count; i++) {
+        out.line(STRF("%s = std::move(%s[%d]);", fn->params[i].c_str(),
+                      args.c_str(), i));
+    }
+    if (fn->hasRest) {
+        out.line(STRF("%s = mal::list(%s.begin() + %d, %s.end());",
+                      fn->params.back().c_str(), args.c_str(), count,
+                      args.c_str()));
+    }
+    out.line("continue;");
+}
+
+String Compiler::compileFn(const malList* list, Scope* scope,
+                           const String& selfName)
+{
+    MAL_CHECK(list->count() == 3, "malformed fn*");
+    const malSequence* bindings = checkSymbols(list->item(1));
+
+    Function fn(scope, selfName);
+    Scope params(scope, &fn);
+    int count = bindings->count();
+    for (int i = 0; i < count; i++) {
+        String name = symbolName(bindings->item(i));
+        if (name == "&") {
+            MAL_CHECK(i == count - 2, "misplaced & in fn*");
+            fn.hasRest = true;
+            continue;
+        }
+        String var = newName("v", name);
+        params.vars.push_back(std::make_pair(name, var));
+        fn.params.push_back(var);
+    }
+
+    Code body;
+    compile(list->item(2), &params, body, "");
+
+    String name = newName("fn");
+    String text = "static malValuePtr " + name + "(const malCompiledFn* self,"
+                  " malValueIter argsBegin,\n" +
+                  String(19 + name.length(), ' ') + "malValueIter argsEnd)\n"
+                  "{\n";
+    if (fn.usesEnv) {
+        text += "    const malEnvPtr& env = self->env();\n";
+    }
+    for (size_t i = 0; i < fn.captureVars.size(); i++) {
+        text += STRF("    const malValuePtr& %s = self->capture(%d);\n",
+                     fn.captureVars[i].c_str(), (int)i);
+    }
+    int fixed = fn.params.size() - (fn.hasRest ? 1 : 0);
+    text += STRF("    checkArgCount(argsBegin, argsEnd, %d, %s);\n",
+                 fixed, fn.hasRest ? "true" : "false");
+    for (int i = 0; i < fixed; i++) {
+        text += STRF("    malValuePtr %s = argsBegin[%d];\n",
+                     fn.params[i].c_str(), i);
+    }
+    if (fn.hasRest) {
+        text += STRF("    malValuePtr %s = mal::list(argsBegin + %d, "
+                     "argsEnd);\n", fn.params.back().c_str(), fixed);
+    }
+    if (fn.loops) {
+        text += "    while (1) {\n";
+        size_t start = 0, end;
+        while ((end = body.text().find('\n', start)) != String::npos) {
+            text += "    " + body.text().substr(start, end + 1 - start);
+            start = end + 1;
+        }
+        text += "    }\n";
+    }
+    else {
+        text += body.text();
+    }
+    m_functions += text + "}\n\n";
+
+    return STRF("mal::compiledFn(%s, %s, malValueVec({ %s }))",
+                name.c_str(), env(scope).c_str(),
+                join(fn.captureFrom).c_str());
+}
+
+// Returns a C++ expression for the value of form: a constant, a local or a
+// new temporary holding the result.
+String Compiler::expr(malValuePtr form, Scope* scope, Code& out)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, form)) {
+        String var = lookup(sym->value(), scope);
+        if (!var.empty()) {
+            return var;
+        }
+    }
+    else if (!DYNAMIC_CAST(malSequence, form) &&
+             !DYNAMIC_CAST(malHash, form)) {
+        return constant(form);
+    }
+    String temp = newName("t");
+    out.line("malValuePtr " + temp + ";");
+    compile(form, scope, out, temp);
+    return temp;
+}
+
+String Compiler::constant(malValuePtr value)
+{
+    if (value == mal::nilValue()) {
+        return "mal::nilValue()";
+    }
+    if (value == mal::trueValue()) {
+        return "mal::trueValue()";
+    }
+    if (value == mal::falseValue()) {
+        return "mal::falseValue()";
+    }
+    bool usesHash = false; // Compiled.h has the helper
+    m_constants.push_back(cppConstruct(value, usesHash));
+    return STRF("K[%d]", (int)m_constants.size() - 1);
+}
+
+String Compiler::env(Scope* scope)
+{
+    if (scope->fn) {
+        scope->fn->usesEnv = true;
+    }
+    return "env";
+}
+
+// Hands form to the interpreter, with every local in sight bound.
+String Compiler::interpretForm(malValuePtr form, Scope* scope)
+{
+    StringVec names, values;
+    std::set<String> seen;
+    for (Scope* s = scope; s; s = s->outer) {
+        for (auto it = s->vars.rbegin(); it != s->vars.rend(); ++it) {
+            if (seen.insert(it->first).second) {
+                names.push_back(it->first);
+            }
+        }
+    }
+    for (auto& name : names) {
+        values.push_back(lookup(name, scope));
+    }
+    return STRF("interpret(%s, %s, { %s }, { %s })",
+                constant(form).c_str(), env(scope).c_str(),
+                quoteAll(names).c_str(), join(values).c_str());
+}
+
+bool Compiler::isKnownMacro(const String& name)
+{
+    if (m_macros.count(name)) {
+        return true;
+    }
+    if (m_defined.count(name)) {
+        return false;
+    }
+    malEnvPtr env = m_interpreter.env()->find(name);
+    return env && isMacro(env->get(name));
+}
+
+// Returns the C++ name of a local, capturing it into the enclosing
+// functions as necessary, or "" for a global.
+String Compiler::lookup(const String& name, Scope* scope)
+{
+    for (Scope* s = scope; s && (s->fn == scope->fn); s = s->outer) {
+        for (auto it = s->vars.rbegin(); it != s->vars.rend(); ++it) {
+            if (it->first == name) {
+                return it->second;
+            }
+        }
+    }
+
+    Function* fn = scope->fn;
+    if (!fn) {
+        return String();
+    }
+    for (size_t i = 0; i < fn->captureNames.size(); i++) {
+        if (fn->captureNames[i] == name) {
+            return fn->captureVars[i];
+        }
+    }
+    String from = lookup(name, fn->definedIn);
+    if (from.empty()) {
+        return String();
+    }
+    String var = newName("c", name);
+    fn->captureNames.push_back(name);
+    fn->captureVars.push_back(var);
+    fn->captureFrom.push_back(from);
+    return var;
+}
+
+String Compiler::newName(const char* prefix, const String& malName)
+{
+    String name = STRF("%s%d", prefix, m_nextId++);
+    if (!malName.empty()) {
+        name += '_';
+        for (char c : malName) {
+            name += isalnum((unsigned char)c) ? c : '_';
+        }
+    }
+    return name;
+}
+
+void Compiler::write(std::ostream& out, bool isRepl, const String& origin)
+{
+    out << "// Generated by malc from " << origin
+        << ". Edit the .mal sources instead.\n"
+           "\n"
+           "#include \"Compiled.h\"\n"
+           "\n"
+        << STRF("static malValuePtr K[%d];\n\n",
+                std::max<int>(m_constants.size(), 1))
+        << m_functions
+        << "static const CompiledForm forms[] = {\n";
+    for (size_t i = 0; i < m_forms.size(); i += 2) {
+        out << "    { " << cppString(m_forms[i]) << ", " << m_forms[i + 1]
+            << " },\n";
+    }
+    out << "};\n"
+           "\n"
+           "int main(int argc, char* argv[])\n"
+           "{\n";
+    for (size_t i = 0; i < m_constants.size(); i++) {
+        out << STRF("    K[%d] = ", (int)i) << m_constants[i] << ";\n";
+    }
+    out << STRF("    return %s(argc, argv, forms, %d);\n",
+                isRepl ? "runCompiledRepl" : "runCompiledProgram",
+                (int)m_forms.size() / 2)
+        << "}\n";
+}
+
+void Compiler::report(std::ostream& out)
+{
+    out << STRF("malc: compiled %d of %d forms, %d macro calls left to the "
+                "interpreter\n", m_compiledForms, (int)m_forms.size() / 2,
+                m_interpretedCalls);
+}
+
+static String readFile(const char* filename)
+{
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename);
+    return String(std::istreambuf_iterator<char>(file.rdbuf()),
+                  std::istreambuf_iterator<char>());
+}
+
+// Each input line of a test file, as the REPL would read it.
+static void addLines(Compiler& compiler, const String& text,
+                     std::set<String>& seen)
+{
+    size_t start = 0;
+    while (start < text.length()) {
+        size_t end = text.find('\n', start);
+        if (end == String::npos) {
+            end = text.length();
+        }
+        String line = text.substr(start, end - start);
+        start = end + 1;
+
+        size_t first = line.find_first_not_of(" \t\r");
+        if ((first == String::npos) || (line[first] == ';') ||
+            !seen.insert(line).second) {
+            continue;
+        }
+        try {
+            compiler.addForm(readStr(line), line);
+        }
+        catch (String&) {
+            // Let the interpreter report the error when it's typed in.
+        }
+        catch (malEmptyInputException&) {
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    bool isRepl = (argc > 1) && (strcmp(argv[1], "--repl") == 0);
+    int first = isRepl ? 2 : 1;
+    if ((argc <= first) || (!isRepl && (argc != 2))) {
+        std::cerr << "Usage: malc FILE.mal > prog.cpp\n"
+                     "       malc --repl FILE.mal... > repl.cpp\n";
+        return 1;
+    }
+
+    Interpreter interpreter;
+    Compiler compiler(interpreter);
+    String origin;
+    try {
+        std::set<String> seen;
+        for (int i = first; i < argc; i++) {
+            String text = readFile(argv[i]);
+            origin += (origin.empty() ? "" : " ") + String(argv[i]);
+            if (isRepl) {
+                addLines(compiler, text, seen);
+                continue;
+            }
+            malValuePtr forms = readStr("[" + text + "\n]");
+            const malSequence* seq = STATIC_CAST(malSequence, forms);
+            for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+                compiler.addForm(*it, "");
+            }
+        }
+    }
+    catch (String& s) {
+        std::cerr << argv[0] << ": " << s << "\n";
+        return 1;
+    }
+
+    compiler.write(std::cout, isRepl, origin);
+    compiler.report(std::cerr);
+    return 0;
+}
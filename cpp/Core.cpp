@@ -1,6 +1,9 @@
 #include "MAL.h"
+#include "ArgStack.h"
 #include "Environment.h"
+#include "Interpreter.h"
 #include "StaticList.h"
+#include "ThreadPool.h"
 #include "Types.h"
 
 #include <chrono>
@@ -61,9 +64,11 @@ static StaticList<malBuiltIn*> handlers;
     }
 
 BUILTIN_ISA("atom?",        malAtom);
+BUILTIN_ISA("future?",      malFuture);
 BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
 BUILTIN_ISA("map?",         malHash);
+BUILTIN_ISA("record?",      malRecord);
 BUILTIN_ISA("sequential?",  malSequence);
 BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
@@ -108,19 +113,26 @@ BUILTIN("=")
     return mal::boolean(lhs->isEqualTo(rhs));
 }
 
+BUILTIN("add-watch")
+{
+    CHECK_ARGS_IS(3);
+    ARG(malAtom, atom);
+    malValuePtr key = *argsBegin++;
+    malValuePtr fn  = *argsBegin++; // this gets checked in APPLY
+    atom->addWatch(key, fn);
+    return atom;
+}
+
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    // Copy the first N-1 arguments in.
-    malValueVec args(argsBegin, argsEnd-1);
-
-    // Then append the argument as a list.
+    // Copy the first N-1 arguments in, then the items of the last.
     const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
-    }
+    ArgStack::Frame args((argsEnd - 1 - argsBegin) + lastArg->count());
+    auto it = std::copy(argsBegin, argsEnd-1, args.begin());
+    std::copy(lastArg->begin(), lastArg->end(), it);
 
     return APPLY(op, args.begin(), args.end());
 }
@@ -133,6 +145,14 @@ BUILTIN("assoc")
     return hash->assoc(argsBegin, argsEnd);
 }
 
+BUILTIN("assoc!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+    transient->assoc(argsBegin, argsEnd);
+    return transient;
+}
+
 BUILTIN("atom")
 {
     CHECK_ARGS_IS(1);
@@ -140,6 +160,38 @@ BUILTIN("atom")
     return mal::atom(*argsBegin);
 }
 
+BUILTIN("atom-stats")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malAtom, atom);
+
+    malHash::Map map;
+    map[":swaps"]   = mal::integer(atom->swapCount());
+    map[":retries"] = mal::integer(atom->retryCount());
+    return mal::hash(map);
+}
+
+BUILTIN("compare-and-set!")
+{
+    CHECK_ARGS_IS(3);
+    ARG(malAtom, atom);
+    malValuePtr expected = *argsBegin++;
+    malValuePtr value    = *argsBegin++;
+
+    // Compare by value, then swap only if the atom still holds the object
+    // that was compared.
+    while (1) {
+        malValuePtr current = atom->deref();
+        if (!current->isEqualTo(expected.ptr())) {
+            return mal::falseValue();
+        }
+        if (atom->compareAndSet(current, value)) {
+            atom->notifyWatches(current, value);
+            return mal::trueValue();
+        }
+    }
+}
+
 BUILTIN("concat")
 {
     int count = 0;
@@ -167,6 +219,14 @@ BUILTIN("conj")
     return seq->conj(argsBegin, argsEnd);
 }
 
+BUILTIN("conj!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+    transient->conj(argsBegin, argsEnd);
+    return transient;
+}
+
 BUILTIN("cons")
 {
     CHECK_ARGS_IS(2);
@@ -204,6 +264,9 @@ BUILTIN("count")
 BUILTIN("deref")
 {
     CHECK_ARGS_IS(1);
+    if (malFuture* future = DYNAMIC_CAST(malFuture, *argsBegin)) {
+        return future->deref();
+    }
     ARG(malAtom, atom);
 
     return atom->deref();
@@ -217,6 +280,14 @@ BUILTIN("dissoc")
     return hash->dissoc(argsBegin, argsEnd);
 }
 
+BUILTIN("dissoc!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+    transient->dissoc(argsBegin, argsEnd);
+    return transient;
+}
+
 BUILTIN("empty?")
 {
     CHECK_ARGS_IS(1);
@@ -228,7 +299,28 @@ BUILTIN("empty?")
 BUILTIN("eval")
 {
     CHECK_ARGS_IS(1);
-    return EVAL(*argsBegin, NULL);
+    return EVAL(analyze(*argsBegin, NULL), NULL);
+}
+
+BUILTIN("extend")
+{
+    CHECK_ARGS_AT_LEAST(3);
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 1,
+              "extend needs a type and then pairs of protocols and maps");
+    malValuePtr type = *argsBegin++;
+    uint32_t tag;
+    if (const malKeyword* keyword = DYNAMIC_CAST(malKeyword, type)) {
+        tag = keyword->typeTag();
+    }
+    else {
+        tag = malProtocol::typeTag(VALUE_CAST(malShape, type));
+    }
+    while (argsBegin != argsEnd) {
+        ARG(malProtocol, protocol);
+        ARG(malHash, fns);
+        protocol->extend(tag, fns);
+    }
+    return mal::nilValue();
 }
 
 BUILTIN("first")
@@ -241,6 +333,36 @@ BUILTIN("first")
     return seq->first();
 }
 
+// Futures run with the interpreter that created them current, so that
+// eval and printing on a worker go to the right place.
+static malValuePtr spawn(malFuture::Body body)
+{
+    Interpreter* interpreter = Interpreter::current();
+    return mal::future([interpreter, body] {
+        Interpreter::Scope scope(interpreter);
+        return body();
+    });
+}
+
+BUILTIN("future-call")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr op = *argsBegin; // this gets checked in APPLY
+
+    return spawn([op] {
+        malValueVec args;
+        return APPLY(op, beginOf(args), endOf(args));
+    });
+}
+
+BUILTIN("future-done?")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malFuture, future);
+
+    return mal::boolean(future->isDone());
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
@@ -270,6 +392,39 @@ BUILTIN("keyword")
     return mal::keyword(":" + token->value());
 }
 
+BUILTIN("memo-stats")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malMemo, memo);
+
+    malHash::Map map;
+    map[":hits"]      = mal::integer(memo->hitCount());
+    map[":misses"]    = mal::integer(memo->missCount());
+    map[":evictions"] = mal::integer(memo->evictionCount());
+    map[":size"]      = mal::integer(memo->size());
+    return mal::hash(map);
+}
+
+BUILTIN("memoize")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr fn = *argsBegin;
+    VALUE_CAST(malApplicable, fn);
+
+    return mal::memo(fn, 0);
+}
+
+BUILTIN("memoize-lru")
+{
+    CHECK_ARGS_IS(2);
+    malValuePtr fn = *argsBegin++;
+    VALUE_CAST(malApplicable, fn);
+    ARG(malInteger, capacity);
+    MAL_CHECK(capacity->value() > 0, "memoize-lru needs a positive capacity");
+
+    return mal::memo(fn, capacity->value());
+}
+
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
@@ -290,6 +445,67 @@ BUILTIN("nth")
     return seq->item(i);
 }
 
+BUILTIN("pcalls")
+{
+    malValueVec futures;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        malValuePtr op = *it;
+        futures.push_back(spawn([op] {
+            malValueVec args;
+            return APPLY(op, beginOf(args), endOf(args));
+        }));
+    }
+
+    malValueVec* items = new malValueVec(futures.size());
+    for (size_t i = 0; i < futures.size(); i++) {
+        (*items)[i] = STATIC_CAST(malFuture, futures[i])->deref();
+    }
+    return mal::list(items);
+}
+
+BUILTIN("persistent!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malTransient, transient);
+    return transient->persistent();
+}
+
+BUILTIN("pmap")
+{
+    CHECK_ARGS_IS(2);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    malValuePtr seqValue = *argsBegin;
+    ARG(malSequence, seq);
+
+    int count = seq->count();
+    if (count == 0) {
+        return mal::list(new malValueVec(0));
+    }
+
+    // A few chunks per worker, so that stealing can even out items which
+    // take different amounts of time.
+    int chunks = std::min(count, ThreadPool::instance().threadCount() * 4);
+    std::shared_ptr<malValueVec> results(new malValueVec(count));
+    malValueVec futures;
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        int begin = chunk * count / chunks;
+        int end = (chunk + 1) * count / chunks;
+        futures.push_back(spawn([=] {
+            const malSequence* items = STATIC_CAST(malSequence, seqValue);
+            for (int i = begin; i < end; i++) {
+                malValueVec args(1, items->item(i));
+                (*results)[i] = APPLY(op, beginOf(args), endOf(args));
+            }
+            return mal::nilValue();
+        }));
+    }
+
+    for (auto& future : futures) {
+        STATIC_CAST(malFuture, future)->deref();
+    }
+    return mal::list(beginOf(*results), endOf(*results));
+}
+
 BUILTIN("pr-str")
 {
     return mal::string(printValues(argsBegin, argsEnd, " ", true));
@@ -297,16 +513,36 @@ BUILTIN("pr-str")
 
 BUILTIN("println")
 {
-    std::cout << printValues(argsBegin, argsEnd, " ", false) << "\n";
+    Interpreter::currentOutput()
+        << printValues(argsBegin, argsEnd, " ", false) << "\n";
     return mal::nilValue();
 }
 
 BUILTIN("prn")
 {
-    std::cout << printValues(argsBegin, argsEnd, " ", true) << "\n";
+    Interpreter::currentOutput()
+        << printValues(argsBegin, argsEnd, " ", true) << "\n";
     return mal::nilValue();
 }
 
+BUILTIN("protocol")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malString, protocolName);
+    return mal::protocol(protocolName->value(), argsBegin, argsEnd);
+}
+
+BUILTIN("protocol-method")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malProtocol, protocol);
+    ARG(malKeyword, method);
+    int index = protocol->methodIndex(method->value());
+    MAL_CHECK(index >= 0, "%s is not a method of %s",
+              method->value().c_str(), protocol->name().c_str());
+    return mal::protocolFn(protocol, index);
+}
+
 BUILTIN("read-string")
 {
     CHECK_ARGS_IS(1);
@@ -323,11 +559,43 @@ BUILTIN("readline")
     return readline(str->value());
 }
 
+BUILTIN("record")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malShape, shape);
+    return mal::record(shape, argsBegin, argsEnd);
+}
+
+BUILTIN("record-shape")
+{
+    return mal::shape(argsBegin, argsEnd);
+}
+
+BUILTIN("remove-watch")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malAtom, atom);
+    atom->removeWatch(*argsBegin);
+    return atom;
+}
+
 BUILTIN("reset!")
 {
     CHECK_ARGS_IS(2);
     ARG(malAtom, atom);
-    return atom->reset(*argsBegin);
+    malValuePtr value = *argsBegin;
+    atom->notifyWatches(atom->reset(value), value);
+    return value;
+}
+
+BUILTIN("reset-vals!")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malAtom, atom);
+    malValuePtr value = *argsBegin;
+    malValuePtr oldValue = atom->reset(value);
+    atom->notifyWatches(oldValue, value);
+    return mal::vector(new malValueVec({ oldValue, value }));
 }
 
 BUILTIN("rest")
@@ -340,6 +608,14 @@ BUILTIN("rest")
     return seq->rest();
 }
 
+BUILTIN("satisfies?")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malProtocol, protocol);
+    malProtocol::Cache cache;
+    return mal::boolean(protocol->implsFor(*argsBegin, cache) != NULL);
+}
+
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
@@ -391,19 +667,34 @@ BUILTIN("str")
     return mal::string(printValues(argsBegin, argsEnd, "", false));
 }
 
-BUILTIN("swap!")
+// swap! and swap-vals! report the value they actually installed, which
+// can differ from a plain deref if another thread got in first.
+static malValuePtr swapAtom(const String& name,
+                            malValueIter argsBegin, malValueIter argsEnd,
+                            malValuePtr& newValue)
 {
     CHECK_ARGS_AT_LEAST(2);
     ARG(malAtom, atom);
 
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    malValueVec args(1 + argsEnd - argsBegin);
-    args[0] = atom->deref();
-    std::copy(argsBegin, argsEnd, args.begin() + 1);
+    malValuePtr oldValue = atom->swap(op, argsBegin, argsEnd, newValue);
+    atom->notifyWatches(oldValue, newValue);
+    return oldValue;
+}
 
-    malValuePtr value = APPLY(op, args.begin(), args.end());
-    return atom->reset(value);
+BUILTIN("swap!")
+{
+    malValuePtr newValue;
+    swapAtom(name, argsBegin, argsEnd, newValue);
+    return newValue;
+}
+
+BUILTIN("swap-vals!")
+{
+    malValuePtr newValue;
+    malValuePtr oldValue = swapAtom(name, argsBegin, argsEnd, newValue);
+    return mal::vector(new malValueVec({ oldValue, newValue }));
 }
 
 BUILTIN("symbol")
@@ -431,6 +722,24 @@ BUILTIN("time-ms")
     return mal::integer(ms.count());
 }
 
+BUILTIN("time-ns")
+{
+    CHECK_ARGS_IS(0);
+
+    using namespace std::chrono;
+    nanoseconds ns = duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()
+    );
+
+    return mal::integer(ns.count());
+}
+
+BUILTIN("transient")
+{
+    CHECK_ARGS_IS(1);
+    return mal::transient(*argsBegin);
+}
+
 BUILTIN("vals")
 {
     CHECK_ARGS_IS(1);
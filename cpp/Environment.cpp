@@ -3,28 +3,68 @@
 
 #include <algorithm>
 
-malEnv::malEnv(malEnvPtr outer)
+malEnv::malEnv(const malEnvPtr& outer)
 : m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
+malEnv::malEnv(const malEnvPtr& outer, const StringVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
 : m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    bind(bindings, argsBegin, argsEnd);
+}
+
+bool malEnv::rebind(const malEnvPtr& outer, const StringVec& bindings,
+                    malValueIter argsBegin, malValueIter argsEnd)
+{
+    if ((refCount() != 1) || (m_outer != outer)) {
+        return false;
+    }
+    // Assigning to the existing entries doesn't allocate, but anything
+    // else in the map, such as a def! made in the body, means starting
+    // afresh.
+    size_t names = 0;
+    for (auto it = bindings.begin(), end = bindings.end(); it != end; ++it) {
+        if (*it != "&") {
+            if (m_map.find(*it) == m_map.end()) {
+                return false;
+            }
+            names++;
+        }
+    }
+    if (m_map.size() != names) {
+        return false;
+    }
+    TRACE_ENV("Reusing malEnv %p, outer=%p\n", this, m_outer.ptr());
+    bind(bindings, argsBegin, argsEnd);
+    return true;
+}
+
+malEnv* malEnv::soleOuter() const
+{
+    if ((refCount() != 1) || !m_outer || (m_outer->refCount() != 1)) {
+        return NULL;
+    }
+    return m_outer.ptr();
+}
+
+void malEnv::bind(const StringVec& bindings,
+                  malValueIter argsBegin, malValueIter argsEnd)
+{
     int n = bindings.size();
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
         if (bindings[i] == "&") {
             MAL_CHECK(i == n - 2, "There must be one parameter after the &");
 
-            set(bindings[n-1], mal::list(it, argsEnd));
+            m_map[bindings[n-1]] = mal::list(it, argsEnd);
             return;
         }
         MAL_CHECK(it != argsEnd, "Not enough parameters");
-        set(bindings[i], *it);
+        m_map[bindings[i]] = *it;
         ++it;
     }
     MAL_CHECK(it == argsEnd, "Too many parameters");
@@ -37,7 +77,7 @@ malEnv::~malEnv()
 
 malEnvPtr malEnv::find(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
         if (env->m_map.find(symbol) != env->m_map.end()) {
             return env;
         }
@@ -45,23 +85,74 @@ malEnvPtr malEnv::find(const String& symbol)
     return NULL;
 }
 
-malValuePtr malEnv::get(const String& symbol)
+const malValuePtr* malEnv::lookup(const String& symbol) const
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
+    for (const malEnv* env = this; env; env = env->m_outer.ptr()) {
         auto it = env->m_map.find(symbol);
         if (it != env->m_map.end()) {
-            return it->second;
+            return &it->second;
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    return NULL;
 }
 
-malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+malEnvPtr malEnv::capture(const StringVec& names, int depth)
 {
+    malEnv* top = this;
+    for (int i = 0; i < depth; i++) {
+        if (!top->m_outer) {
+            return NULL;
+        }
+        top = top->m_outer.ptr();
+    }
+    if (names.empty()) {
+        return top;
+    }
+
+    malEnvPtr record(new malEnv(top));
+    for (auto name = names.begin(), end = names.end(); name != end; ++name) {
+        bool isFound = false;
+        for (malEnv* env = this; env != top; env = env->m_outer.ptr()) {
+            auto it = env->m_map.find(*name);
+            if (it != env->m_map.end()) {
+                record->m_map[*name] = it->second;
+                isFound = true;
+                break;
+            }
+        }
+        if (!isFound) {
+            return NULL;
+        }
+    }
+    return record;
+}
+
+malValuePtr malEnv::get(const String& symbol)
+{
+    const malValuePtr* value = lookup(symbol);
+    MAL_CHECK(value != NULL, "'%s' not found", symbol.c_str());
+    return *value;
+}
+
+malValuePtr malEnv::set(const String& symbol, const malValuePtr& value)
+{
+    malFolded::noteBinding(symbol);
+    malFieldSite::noteBinding(symbol);
     m_map[symbol] = value;
     return value;
 }
 
+void malEnv::freeze()
+{
+    for (malEnvPtr env = this; env && !env->isImmortal(); env = env->m_outer) {
+        env->makeImmortal();
+        for (auto it = env->m_map.begin(), end = env->m_map.end();
+             it != end; ++it) {
+            it->second->freeze();
+        }
+    }
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
@@ -7,8 +7,8 @@
 
 class malEnv : public RefCounted {
 public:
-    malEnv(malEnvPtr outer = NULL);
-    malEnv(malEnvPtr outer,
+    malEnv(const malEnvPtr& outer = NULL);
+    malEnv(const malEnvPtr& outer,
            const StringVec& bindings,
            malValueIter argsBegin,
            malValueIter argsEnd);
@@ -17,10 +17,45 @@ public:
 
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
-    malValuePtr set(const String& symbol, malValuePtr value);
+    // Binds symbol as def! does. Rebinding one of the folded builtins
+    // here invalidates whatever was folded with the old one.
+    malValuePtr set(const String& symbol, const malValuePtr& value);
+
+    // Binds a let* or catch* local, which the analysis pass already knows
+    // about, so it can't affect anything folded.
+    void bindLocal(const String& symbol, const malValuePtr& value) {
+        m_map[symbol] = value;
+    }
+
+    // The value bound to symbol, borrowed from its env, or NULL. It's only
+    // good until that binding changes.
+    const malValuePtr* lookup(const String& symbol) const;
     malEnvPtr   getRoot();
 
+    // Binds a tail call's arguments into this frame in place of the ones
+    // it holds, if nothing else refers to it and it was made for the same
+    // outer env and names. Returns false if a new frame is needed instead.
+    bool rebind(const malEnvPtr& outer, const StringVec& bindings,
+                malValueIter argsBegin, malValueIter argsEnd);
+
+    // The frame this one was made inside, such as a lambda's frame under
+    // one made by a let* in its body, if nothing else refers to either of
+    // them. NULL otherwise.
+    malEnv* soleOuter() const;
+
+    // A frame holding the values of names, found in the depth frames
+    // nearest this one, whose outer env is the one beyond those. It's that
+    // env itself if there are no names, and NULL if any of them isn't
+    // bound in those frames.
+    malEnvPtr capture(const StringVec& names, int depth);
+
+    // Makes this env, its outer envs and all of their values immortal.
+    void freeze();
+
 private:
+    void bind(const StringVec& bindings,
+              malValueIter argsBegin, malValueIter argsEnd);
+
     typedef std::map<String, malValuePtr> Map;
     Map m_map;
     malEnvPtr m_outer;
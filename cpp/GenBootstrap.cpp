@@ -0,0 +1,163 @@
+#include "CodeGen.h"
+#include "MAL.h"
+#include "Types.h"
+
+#include <fstream>
+#include <iostream>
+
+// Build-time generator for Bootstrap.cpp. It reads the given mal files and
+// writes out C++ which builds the same forms directly, so the interpreter
+// doesn't run the reader at startup. Top-level definitions of functions and
+// macros become lambdas built in place, whose bodies go through the same
+// analysis as forms given to EVAL; anything else is handed to EVAL.
+//
+//  Usage: genbootstrap FILE... > Bootstrap.cpp
+
+// Types.cpp refers to these, but reading never gets as far as calling them.
+malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+{
+    MAL_FAIL("genbootstrap can't evaluate");
+}
+
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_FAIL("genbootstrap can't apply");
+}
+
+// Which of the helper functions the generated code needs.
+static bool s_usesHash = false;
+static bool s_usesLambda = false;
+static bool s_usesMacro = false;
+
+static String construct(malValuePtr value)
+{
+    return cppConstruct(value, s_usesHash);
+}
+
+static bool isSymbol(malValuePtr value, const char* name)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, value);
+    return sym && (sym->value() == name);
+}
+
+// Recognises (def! name (fn* params body)) and (defmacro! ...) of the same.
+static bool isDefinition(const malList* form, bool& isMacro)
+{
+    if (!form || (form->count() != 3)) {
+        return false;
+    }
+    isMacro = isSymbol(form->item(0), "defmacro!");
+    if (!isMacro && !isSymbol(form->item(0), "def!")) {
+        return false;
+    }
+    const malList* fn = DYNAMIC_CAST(malList, form->item(2));
+    if (!fn || (fn->count() != 3) || !isSymbol(fn->item(0), "fn*") ||
+        !DYNAMIC_CAST(malSymbol, form->item(1))) {
+        return false;
+    }
+    const malSequence* params = DYNAMIC_CAST(malSequence, fn->item(1));
+    if (!params) {
+        return false;
+    }
+    for (auto it = params->begin(), end = params->end(); it != end; ++it) {
+        if (!DYNAMIC_CAST(malSymbol, *it)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static String statement(malValuePtr value)
+{
+    bool isMacro;
+    const malList* form = DYNAMIC_CAST(malList, value);
+    if (!isDefinition(form, isMacro)) {
+        return "    EVAL(" + construct(value) + ", env);\n";
+    }
+
+    const malSymbol* name = STATIC_CAST(malSymbol, form->item(1));
+    const malList* fn = STATIC_CAST(malList, form->item(2));
+    const malSequence* params = STATIC_CAST(malSequence, fn->item(1));
+
+    String paramList = "{ ";
+    for (auto it = params->begin(), end = params->end(); it != end; ++it) {
+        paramList += cppString(STATIC_CAST(malSymbol, *it)->value()) + ", ";
+    }
+    paramList += "}";
+    s_usesLambda = true;
+    s_usesMacro |= isMacro;
+
+    return STRF("    env->set(%s, %s(%s,\n        %s, env));\n",
+                cppString(name->value()).c_str(),
+                isMacro ? "macro" : "lambda",
+                paramList.c_str(),
+                construct(fn->item(2)).c_str());
+}
+
+static String readFile(const char* filename)
+{
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename);
+    return String(std::istreambuf_iterator<char>(file.rdbuf()),
+                  std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char* argv[])
+{
+    String body;
+    try {
+        for (int i = 1; i < argc; i++) {
+            malValuePtr forms = readStr("[" + readFile(argv[i]) + "\n]");
+            const malSequence* seq = STATIC_CAST(malSequence, forms);
+            for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+                body += statement(*it);
+            }
+        }
+    }
+    catch (String& s) {
+        std::cerr << argv[0] << ": " << s << "\n";
+        return 1;
+    }
+
+    std::cout <<
+        "// Generated by genbootstrap. Edit the .mal sources instead.\n"
+        "\n"
+        "#include \"Bootstrap.h\"\n"
+        "#include \"Environment.h\"\n"
+        "#include \"Types.h\"\n"
+        "\n";
+    if (s_usesHash) {
+        std::cout <<
+            "static malValuePtr hash(malValueVec items)\n"
+            "{\n"
+            "    return mal::hash(beginOf(items), endOf(items), false);\n"
+            "}\n"
+            "\n";
+    }
+    if (s_usesLambda) {
+        std::cout <<
+            "static malValuePtr lambda(const StringVec& params,\n"
+            "                          malValuePtr body, malEnvPtr env)\n"
+            "{\n"
+            "    return mal::lambda(params, analyzeBody(params, body, env), env);\n"
+            "}\n"
+            "\n";
+    }
+    if (s_usesMacro) {
+        std::cout <<
+            "static malValuePtr macro(const StringVec& params,\n"
+            "                         malValuePtr body, malEnvPtr env)\n"
+            "{\n"
+            "    malValuePtr fn = lambda(params, body, env);\n"
+            "    return mal::macro(*STATIC_CAST(malLambda, fn));\n"
+            "}\n"
+            "\n";
+    }
+    std::cout <<
+        "void installBootstrap(malEnvPtr env)\n"
+        "{\n"
+        << body <<
+        "}\n";
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "Interpreter.h"
+#include "Bootstrap.h"
+
+static thread_local Interpreter* s_current = NULL;
+
+Interpreter::Interpreter()
+: m_env(new malEnv)
+, m_output(&std::cout)
+{
+    Scope scope(this);
+
+    installCore(m_env);
+    installBootstrap(m_env);
+    m_env->set("*ARGV*", mal::list(new malValueVec()));
+}
+
+Interpreter::Interpreter(malEnvPtr outer)
+: m_env(new malEnv(outer))
+, m_output(&std::cout)
+{
+
+}
+
+malValuePtr Interpreter::eval(const String& source)
+{
+    // Everything is read before anything is evaluated, so that unbalanced
+    // input fails without running any of it.
+    malValuePtr forms = readAll(source);
+    const malList* list = STATIC_CAST(malList, forms);
+    malValuePtr result = mal::nilValue();
+    for (auto it = list->begin(), end = list->end(); it != end; ++it) {
+        result = eval(*it);
+    }
+    return result;
+}
+
+malValuePtr Interpreter::eval(malValuePtr ast)
+{
+    Scope scope(this);
+    return EVAL(analyze(ast, m_env), m_env);
+}
+
+String Interpreter::rep(const String& input)
+{
+    Scope scope(this);
+    return ::rep(input, m_env);
+}
+
+malValuePtr Interpreter::call(malValuePtr fn, malValueIter argsBegin,
+                                              malValueIter argsEnd)
+{
+    Scope scope(this);
+    return APPLY(fn, argsBegin, argsEnd);
+}
+
+void Interpreter::set(const String& name, malValuePtr value)
+{
+    m_env->set(name, value);
+}
+
+malValuePtr Interpreter::readLine(const String& prompt)
+{
+    String line;
+    if (m_input && m_input(prompt, line)) {
+        return mal::string(line);
+    }
+    return mal::nilValue();
+}
+
+malValuePtr Interpreter::toValue(const std::vector<int64_t>& values)
+{
+    malValueVec* items = new malValueVec(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        (*items)[i] = mal::integer(values[i]);
+    }
+    return mal::list(items);
+}
+
+malValuePtr Interpreter::toValue(const std::vector<String>& values)
+{
+    malValueVec* items = new malValueVec(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        (*items)[i] = mal::string(values[i]);
+    }
+    return mal::list(items);
+}
+
+int64_t Interpreter::toInteger(malValuePtr value)
+{
+    return VALUE_CAST(malInteger, value)->value();
+}
+
+String Interpreter::toString(malValuePtr value)
+{
+    return VALUE_CAST(malString, value)->value();
+}
+
+malValueVec Interpreter::toVector(malValuePtr value)
+{
+    const malSequence* seq = VALUE_CAST(malSequence, value);
+    return malValueVec(seq->begin(), seq->end());
+}
+
+Interpreter* Interpreter::current()
+{
+    return s_current;
+}
+
+std::ostream& Interpreter::currentOutput()
+{
+    return s_current ? s_current->output() : std::cout;
+}
+
+Interpreter::Scope::Scope(Interpreter* interpreter)
+: m_previous(s_current)
+{
+    s_current = interpreter;
+}
+
+Interpreter::Scope::~Scope()
+{
+    s_current = m_previous;
+}
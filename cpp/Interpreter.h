@@ -0,0 +1,108 @@
+#ifndef INCLUDE_INTERPRETER_H
+#define INCLUDE_INTERPRETER_H
+
+#include "MAL.h"
+
+#include "Environment.h"
+#include "Types.h"
+
+#include <functional>
+#include <iostream>
+
+// An interpreter instance: a root environment with the core functions and
+// the stepA prelude installed, plus the streams that prn, println and
+// readline use. Separate instances have their own environments, so a host
+// can run one per worker thread. Call RefCounted::enableThreading() before
+// starting the threads, because immutable values such as nil and the
+// builtins are still shared between them.
+//
+// A little state is process-wide, and all of it is atomic or locked:
+// malFolded's and malFieldSite's epochs, which a def! of a folded operator
+// or of get or assoc in any instance bumps, so that every instance's
+// caches are rechecked; the counter which numbers record shapes; and the
+// table of protocol type tags, so a :type keyword has the same tag in
+// every instance.
+//
+// Errors propagate as they do inside the interpreter: a String for
+// internal errors, a malValuePtr for values thrown by mal code.
+//
+//  Interpreter mal;
+//  mal.eval("(def! sq (fn* [x] (* x x)))");
+//  int64_t n = Interpreter::toInteger(mal.call("sq", 12));
+class Interpreter {
+public:
+    typedef std::function<bool (const String& prompt, String& line)> Input;
+
+    Interpreter();
+
+    // A session whose globals live in a child of outer, an environment
+    // which already has the core and prelude installed. Definitions made
+    // in the session are not seen by others sharing the same outer.
+    explicit Interpreter(malEnvPtr outer);
+
+    malEnvPtr env() const { return m_env; }
+
+    // Reads all of the forms in source, then evaluates them in turn,
+    // returning the value of the last one, or nil if there are none.
+    malValuePtr eval(const String& source);
+    malValuePtr eval(malValuePtr ast);
+
+    // Read-eval-print of a single form, as the REPL does it.
+    String rep(const String& input);
+
+    malValuePtr call(malValuePtr fn, malValueIter argsBegin,
+                                     malValueIter argsEnd);
+
+    template <typename... Args>
+    malValuePtr call(const String& name, Args... args) {
+        malValueVec argVec { toValue(args)... };
+        return call(get(name), beginOf(argVec), endOf(argVec));
+    }
+
+    malValuePtr get(const String& name) const { return m_env->get(name); }
+    void set(const String& name, malValuePtr value);
+
+    std::ostream& output() const { return *m_output; }
+    void setOutput(std::ostream& output) { m_output = &output; }
+    void setInput(Input input) { m_input = input; }
+    malValuePtr readLine(const String& prompt);
+
+    // Conversions between native and mal values.
+    static malValuePtr toValue(malValuePtr value) { return value; }
+    static malValuePtr toValue(int64_t value) { return mal::integer(value); }
+    static malValuePtr toValue(int value) { return mal::integer(value); }
+    static malValuePtr toValue(bool value) { return mal::boolean(value); }
+    static malValuePtr toValue(const char* value) { return mal::string(value); }
+    static malValuePtr toValue(const String& value) { return mal::string(value); }
+    static malValuePtr toValue(const std::vector<int64_t>& values);
+    static malValuePtr toValue(const std::vector<String>& values);
+
+    static int64_t toInteger(malValuePtr value);
+    static String toString(malValuePtr value);
+    static bool toBool(malValuePtr value) { return value->isTrue(); }
+    static malValueVec toVector(malValuePtr value);
+
+    // The interpreter running on this thread, if any.
+    static Interpreter* current();
+    static std::ostream& currentOutput();
+
+    // Makes an interpreter current on this thread until the scope exits.
+    class Scope {
+    public:
+        Scope(Interpreter* interpreter);
+        ~Scope();
+
+    private:
+        Interpreter* m_previous;
+    };
+
+private:
+    Interpreter(const Interpreter&); // no copy ctor
+    Interpreter& operator = (const Interpreter&); // no assignments
+
+    malEnvPtr     m_env;
+    std::ostream* m_output;
+    Input         m_input;
+};
+
+#endif // INCLUDE_INTERPRETER_H
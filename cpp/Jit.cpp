@@ -0,0 +1,511 @@
+#include "Jit.h"
+
+#ifdef MAL_JIT
+
+#include "ArgStack.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// What the native code left for jitEnter.
+enum JitOutcome { JitValue, JitTailEval, JitTailCall };
+
+// The native code's working state. It holds everything in slots, so that
+// reference counting stays in the helpers.
+struct JitFrame {
+    JitFrame(const malEnvPtr& env, int slotCount)
+    : env(env), slots(slotCount), outcome(JitValue), callBase(0)
+    , callCount(0) { }
+
+    malEnvPtr          env;
+    ArgStack::Frame    slots;
+    JitOutcome         outcome;
+    malValuePtr        result;      // the value, or the form to evaluate
+    int                callBase;    // the slots of a tail call: op, args...
+    int                callCount;
+    std::exception_ptr error;       // exceptions can't unwind native code
+};
+
+struct JitCode {
+    typedef void (*Entry)(JitFrame* frame);
+
+    Entry       entry;
+    size_t      size;       // of the mapping
+    int         slotCount;
+    malValuePtr body;       // whose nodes the code points at
+};
+
+static std::atomic<int>     s_functions(0);
+static std::atomic<int64_t> s_bytes(0);
+static std::atomic<int64_t> s_compileNs(0);
+static std::atomic<int64_t> s_entries(0);
+static std::mutex           s_compileLock;
+
+static int threshold()
+{
+    static const int s_threshold = getenv("MAL_JIT_THRESHOLD")
+                                 ? atoi(getenv("MAL_JIT_THRESHOLD")) : 100;
+    return s_threshold;
+}
+
+// The helpers the native code calls. Each returns a negative number if it
+// threw, having kept the exception for jitEnter to rethrow.
+
+#define JIT_HELPER_BEGIN try {
+#define JIT_HELPER_END \
+    } \
+    catch (...) { \
+        frame->error = std::current_exception(); \
+        return -1; \
+    }
+
+static int jitConst(JitFrame* frame, int dest, malValue* value)
+{
+    frame->slots[dest] = malValuePtr(value);
+    return 0;
+}
+
+static int jitLookup(JitFrame* frame, int dest, const malSymbol* symbol)
+{
+    JIT_HELPER_BEGIN
+    frame->slots[dest] = frame->env->get(symbol->value());
+    return 0;
+    JIT_HELPER_END
+}
+
+// Looks up the head of a call, returning 1 if it's a macro.
+static int jitHead(JitFrame* frame, int dest, const malSymbol* symbol)
+{
+    JIT_HELPER_BEGIN
+    malValuePtr op = frame->env->get(symbol->value());
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    frame->slots[dest] = op;
+    return lambda && lambda->isMacro() ? 1 : 0;
+    JIT_HELPER_END
+}
+
+static int jitIsTrue(JitFrame* frame, int slot)
+{
+    return frame->slots[slot]->isTrue() ? 1 : 0;
+}
+
+static int jitCall(JitFrame* frame, int base, int count, int dest)
+{
+    JIT_HELPER_BEGIN
+    auto begin = frame->slots.begin() + base;
+    const malBuiltIn* builtIn = DYNAMIC_CAST(malBuiltIn, *begin);
+    malValuePtr value = builtIn && (count == 2) &&
+                        (builtIn->inlineOp() != malBuiltIn::NotInline)
+                      ? builtIn->applyInline(begin[1], begin[2])
+                      : APPLY(*begin, begin + 1, begin + 1 + count);
+    frame->slots[dest] = value;
+    return 0;
+    JIT_HELPER_END
+}
+
+static int jitEval(JitFrame* frame, malValue* ast, int dest)
+{
+    JIT_HELPER_BEGIN
+    frame->slots[dest] = EVAL(ast, frame->env);
+    return 0;
+    JIT_HELPER_END
+}
+
+static int jitTailCall(JitFrame* frame, int base, int count)
+{
+    frame->outcome = JitTailCall;
+    frame->callBase = base;
+    frame->callCount = count;
+    return 0;
+}
+
+static int jitTailEval(JitFrame* frame, malValue* ast)
+{
+    frame->outcome = JitTailEval;
+    frame->result = ast;
+    return 0;
+}
+
+static int jitReturn(JitFrame* frame, int slot)
+{
+    frame->outcome = JitValue;
+    frame->result = frame->slots[slot];
+    return 0;
+}
+
+// Just enough of an x86-64 assembler. The frame pointer lives in rbx for
+// the whole function, and every helper call is followed by a check which
+// bails out to the epilogue if it threw.
+class Assembler {
+public:
+    struct Label {
+        Label() : pos(-1) { }
+        int pos;
+        std::vector<int> uses;
+    };
+
+    void prologue() {
+        emit({ 0x53 });                         // push rbx
+        emit({ 0x48, 0x89, 0xFB });             // mov rbx, rdi
+    }
+
+    void epilogue() {
+        bind(m_epilogue);
+        emit({ 0x5B, 0xC3 });                   // pop rbx; ret
+    }
+
+    // Calls helper(frame, a, b, c), leaving its result in eax.
+    template <typename Helper>
+    void call(Helper helper, uint64_t a, uint64_t b = 0, uint64_t c = 0) {
+        emit({ 0x48, 0x89, 0xDF });             // mov rdi, rbx
+        emit({ 0x48, 0xBE }); imm64(a);         // mov rsi, a
+        emit({ 0x48, 0xBA }); imm64(b);         // mov rdx, b
+        emit({ 0x48, 0xB9 }); imm64(c);         // mov rcx, c
+        emit({ 0x48, 0xB8 });                   // mov rax, helper
+        imm64(reinterpret_cast<uint64_t>(helper));
+        emit({ 0xFF, 0xD0 });                   // call rax
+        emit({ 0x85, 0xC0 });                   // test eax, eax
+        jump(0x88, m_epilogue);                 // js epilogue
+    }
+
+    void jumpIfZero(Label& label)    { jump(0x84, label); }
+    void jumpIfNotZero(Label& label) { jump(0x85, label); }
+    void jump(Label& label)          { jump(0, label); }
+    void leave()                     { jump(0, m_epilogue); }
+
+    void bind(Label& label) {
+        label.pos = m_code.size();
+        for (int use : label.uses) {
+            patch(use, label.pos - (use + 4));
+        }
+    }
+
+    const std::vector<uint8_t>& code() const { return m_code; }
+
+private:
+    void emit(std::initializer_list<uint8_t> bytes) {
+        m_code.insert(m_code.end(), bytes);
+    }
+
+    void imm64(uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            m_code.push_back(uint8_t(value >> (8 * i)));
+        }
+    }
+
+    // A rel32 jump: jmp if condition is 0, otherwise jcc.
+    void jump(uint8_t condition, Label& label) {
+        if (condition) {
+            emit({ 0x0F, condition });
+        }
+        else {
+            emit({ 0xE9 });
+        }
+        int use = m_code.size();
+        emit({ 0, 0, 0, 0 });
+        if (label.pos >= 0) {
+            patch(use, label.pos - (use + 4));
+        }
+        else {
+            label.uses.push_back(use);
+        }
+    }
+
+    void patch(int offset, int32_t value) {
+        memcpy(&m_code[offset], &value, 4);
+    }
+
+    std::vector<uint8_t> m_code;
+    Label                m_epilogue;
+};
+
+class JitCompiler {
+public:
+    JitCompiler() : m_slotCount(1), m_maxSlots(1) { }
+
+    int compileBody(malValuePtr body) {
+        m_asm.prologue();
+        compile(body, 0, true);
+        m_asm.epilogue();
+        return m_maxSlots;
+    }
+
+    const std::vector<uint8_t>& code() const { return m_asm.code(); }
+
+private:
+    typedef Assembler::Label Label;
+
+    void compile(malValuePtr ast, int dest, bool isTail);
+    void compileCall(const malList* list, int dest, bool isTail);
+    void constant(malValue* value, int dest, bool isTail);
+    void interpret(malValuePtr ast, int dest, bool isTail);
+    void finish(int dest, bool isTail);
+
+    int newSlot() {
+        m_maxSlots = std::max(m_maxSlots, m_slotCount + 1);
+        return m_slotCount++;
+    }
+
+    Assembler m_asm;
+    int       m_slotCount;
+    int       m_maxSlots;
+};
+
+void JitCompiler::compile(malValuePtr ast, int dest, bool isTail)
+{
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || (list->count() == 0)) {
+        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, ast)) {
+            m_asm.call(jitLookup, dest, reinterpret_cast<uint64_t>(symbol));
+            finish(dest, isTail);
+        }
+        else if (!ast->isLiteral()) {
+            interpret(ast, dest, isTail);
+        }
+        else {
+            constant(ast.ptr(), dest, isTail);
+        }
+        return;
+    }
+
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    String special = symbol ? symbol->value() : "";
+    int argCount = list->count() - 1;
+
+    if ((special == "if") && ((argCount == 2) || (argCount == 3))) {
+        int test = newSlot();
+        compile(list->item(1), test, false);
+        m_slotCount--;
+
+        Label otherwise, end;
+        m_asm.call(jitIsTrue, test);
+        m_asm.jumpIfZero(otherwise);
+        compile(list->item(2), dest, isTail);
+        if (!isTail) {
+            m_asm.jump(end);
+        }
+        m_asm.bind(otherwise);
+        if (argCount == 3) {
+            compile(list->item(3), dest, isTail);
+        }
+        else {
+            constant(mal::nilValue().ptr(), dest, isTail);
+        }
+        m_asm.bind(end);
+    }
+    else if ((special == "do") && (argCount >= 1)) {
+        int ignored = newSlot();
+        for (int i = 1; i < argCount; i++) {
+            compile(list->item(i), ignored, false);
+        }
+        m_slotCount--;
+        compile(list->item(argCount), dest, isTail);
+    }
+    else if ((special == "def!") || (special == "defmacro!") ||
+             (special == "do") || (special == "fn*") || (special == "if") ||
+             (special == "let*") || (special == "macroexpand") ||
+             (special == "quasiquote") || (special == "quote") ||
+             (special == "try*")) {
+        interpret(ast, dest, isTail);
+    }
+    else {
+        compileCall(list, dest, isTail);
+    }
+}
+
+void JitCompiler::compileCall(const malList* list, int dest, bool isTail)
+{
+    int count = list->count();
+    int base = m_slotCount;
+    for (int i = 0; i < count; i++) {
+        newSlot();
+    }
+
+    Label isMacro, end;
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (head) {
+        m_asm.call(jitHead, base, reinterpret_cast<uint64_t>(head));
+        m_asm.jumpIfNotZero(isMacro);
+    }
+    else {
+        compile(list->item(0), base, false);
+    }
+    for (int i = 1; i < count; i++) {
+        compile(list->item(i), base + i, false);
+    }
+
+    if (isTail) {
+        m_asm.call(jitTailCall, base, count - 1);
+        m_asm.leave();
+    }
+    else {
+        m_asm.call(jitCall, base, count - 1, dest);
+        m_asm.jump(end);
+    }
+    if (head) {
+        // Its expansion might be anything, so leave it to EVAL.
+        m_asm.bind(isMacro);
+        interpret(const_cast<malList*>(list), dest, isTail);
+    }
+    m_asm.bind(end);
+    m_slotCount = base;
+}
+
+void JitCompiler::constant(malValue* value, int dest, bool isTail)
+{
+    m_asm.call(jitConst, dest, reinterpret_cast<uint64_t>(value));
+    finish(dest, isTail);
+}
+
+void JitCompiler::interpret(malValuePtr ast, int dest, bool isTail)
+{
+    if (isTail) {
+        m_asm.call(jitTailEval, reinterpret_cast<uint64_t>(ast.ptr()));
+        m_asm.leave();
+    }
+    else {
+        m_asm.call(jitEval, reinterpret_cast<uint64_t>(ast.ptr()), dest);
+    }
+}
+
+void JitCompiler::finish(int dest, bool isTail)
+{
+    if (isTail) {
+        m_asm.call(jitReturn, dest);
+        m_asm.leave();
+    }
+}
+
+JitCode* jitCompile(malValuePtr body)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    JitCompiler compiler;
+    int slotCount = compiler.compileBody(body);
+    const std::vector<uint8_t>& code = compiler.code();
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = (code.size() + pageSize - 1) / pageSize * pageSize;
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return NULL;
+    }
+
+    JitCode* jit = new JitCode;
+    jit->entry = reinterpret_cast<JitCode::Entry>(memory);
+    jit->size = size;
+    jit->slotCount = slotCount;
+    jit->body = body;
+
+    s_functions++;
+    s_bytes += code.size();
+    s_compileNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return jit;
+}
+
+void jitFree(JitCode* code)
+{
+    if (code) {
+        munmap(reinterpret_cast<void*>(code->entry), code->size);
+        delete code;
+    }
+}
+
+JitCode* malLambda::jit() const
+{
+    JitCode* code = m_jitCode.load(std::memory_order_acquire);
+    if (code ||
+        (m_jitCalls.fetch_add(1, std::memory_order_relaxed) < threshold())) {
+        return code;
+    }
+
+    std::lock_guard<std::mutex> lock(s_compileLock);
+    code = m_jitCode.load(std::memory_order_relaxed);
+    if (!code) {
+        code = jitCompile(m_body);
+        if (!code) {
+            m_jitCalls = INT_MIN; // out of memory, so don't keep trying
+        }
+        m_jitCode.store(code, std::memory_order_release);
+    }
+    return code;
+}
+
+bool jitEnter(const malLambda* lambda, malValuePtr& ast, malEnvPtr& env,
+              malValuePtr& result)
+{
+    malValuePtr current; // keeps tail-called lambdas alive
+    while (1) {
+        JitCode* code = lambda->isMacro() ? NULL : lambda->jit();
+        if (!code) {
+            return false;
+        }
+
+        s_entries.fetch_add(1, std::memory_order_relaxed);
+        JitFrame frame(env, code->slotCount);
+        code->entry(&frame);
+        if (frame.error) {
+            std::rethrow_exception(frame.error);
+        }
+
+        switch (frame.outcome) {
+            case JitValue:
+                result = frame.result;
+                return true;
+
+            case JitTailEval:
+                ast = frame.result;
+                return false;
+
+            case JitTailCall: {
+                auto begin = frame.slots.begin() + frame.callBase;
+                auto argsBegin = begin + 1;
+                auto argsEnd = argsBegin + frame.callCount;
+                const malLambda* next = DYNAMIC_CAST(malLambda, *begin);
+                if (!next) {
+                    result = APPLY(*begin, argsBegin, argsEnd);
+                    return true;
+                }
+                current = *begin;
+                lambda = next;
+                ast = next->getBody();
+                frame.env = NULL; // so the frame can be reused
+                next->makeTailEnv(env, argsBegin, argsEnd);
+                break;
+            }
+        }
+    }
+}
+
+String jitStats()
+{
+    return STRF("jit: %d functions compiled, %lld bytes of code, "
+                "%lld us compiling, %lld entries",
+                s_functions.load(), (long long)s_bytes.load(),
+                (long long)s_compileNs.load() / 1000,
+                (long long)s_entries.load());
+}
+
+#else
+
+String jitStats()
+{
+    return "jit: not built in, use make JIT=1";
+}
+
+#endif // MAL_JIT
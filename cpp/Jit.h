@@ -0,0 +1,38 @@
+#ifndef INCLUDE_JIT_H
+#define INCLUDE_JIT_H
+
+#include "MAL.h"
+
+// A baseline JIT for the bodies of hot lambdas, built in with `make JIT=1`.
+// Once a lambda has been called MAL_JIT_THRESHOLD times (100 by default)
+// its body is compiled to x86-64 code which calls runtime helpers for each
+// step: symbol lookups, calls, and branches on if. Anything else, and any
+// call whose head turns out to be a macro, is handed to EVAL. Tail calls
+// come back out to jitEnter's loop, so they still don't grow the stack.
+
+#ifdef MAL_JIT
+
+#ifndef __x86_64__
+#error "JIT=1 needs an x86-64 build"
+#endif
+
+class malLambda;
+struct JitCode;
+
+// Compiles body, never failing: whatever the JIT can't handle it leaves
+// to EVAL.
+JitCode* jitCompile(malValuePtr body);
+void jitFree(JitCode* code);
+
+// Runs lambda's body, whose environment is env, if it has been compiled.
+// Returns true with the value in result, or false with ast and env set
+// for EVAL to carry on with.
+bool jitEnter(const malLambda* lambda, malValuePtr& ast, malEnvPtr& env,
+              malValuePtr& result);
+
+#endif // MAL_JIT
+
+// A line of statistics for --jit-stats.
+String jitStats();
+
+#endif // INCLUDE_JIT_H
@@ -11,22 +11,36 @@
 class malValue;
 typedef RefCountedPtr<malValue>  malValuePtr;
 typedef std::vector<malValuePtr> malValueVec;
-typedef malValueVec::iterator    malValueIter;
+typedef malValuePtr*             malValueIter;
+
+// A vector's items as a range of malValueIters.
+inline malValueIter beginOf(malValueVec& items) { return items.data(); }
+inline malValueIter endOf(malValueVec& items)
+{
+    return items.data() + items.size();
+}
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
 // step*.cpp
-extern malValuePtr APPLY(malValuePtr op,
+extern malValuePtr APPLY(const malValuePtr& op,
                          malValueIter argsBegin, malValueIter argsEnd);
 extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
 extern malValuePtr readline(const String& prompt);
 extern String rep(const String& input, malEnvPtr env);
 
+// Analysis.cpp
+extern malValuePtr analyze(malValuePtr ast, malEnvPtr env);
+extern malValuePtr analyzeBody(const StringVec& params, malValuePtr body,
+                               malEnvPtr env);
+
 // Core.cpp
 extern void installCore(malEnvPtr env);
 
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
+// Reads every form in input, which may be none, into a list.
+extern malValuePtr readAll(const String& input);
 
 #endif // INCLUDE_MAL_H
@@ -5,17 +5,26 @@
 
 typedef std::regex              Regex;
 
-static const Regex intRegex("^[-+]?\\d+$");
-static const Regex closeRegex("[\\)\\]}]");
-
-static const Regex whitespaceRegex("[\\s,]+|;.*");
-static const Regex tokenRegexes[] = {
-    Regex("~@"),
-    Regex("[\\[\\]{}()'`~^@]"),
-    Regex("\"(?:\\\\.|[^\\\\\"])*\""),
-    Regex("[^\\s\\[\\]{}('\"`,;)]+"),
+// Compiling these is a good part of the cost of starting up, so it is put
+// off until something is actually read.
+struct Regexes {
+    const Regex intRegex        { "^[-+]?\\d+$" };
+    const Regex closeRegex      { "[\\)\\]}]" };
+    const Regex whitespaceRegex { "[\\s,]+|;.*" };
+    const Regex tokenRegexes[4] {
+        Regex("~@"),
+        Regex("[\\[\\]{}()'`~^@]"),
+        Regex("\"(?:\\\\.|[^\\\\\"])*\""),
+        Regex("[^\\s\\[\\]{}('\"`,;)]+"),
+    };
 };
 
+static const Regexes& regexes()
+{
+    static Regexes regexes;
+    return regexes;
+}
+
 class Tokeniser
 {
 public:
@@ -90,7 +99,7 @@ void Tokeniser::nextToken()
         return;
     }
 
-    for (auto &it : tokenRegexes) {
+    for (auto &it : regexes().tokenRegexes) {
         if (matchRegex(it)) {
             return;
         }
@@ -107,7 +116,7 @@ void Tokeniser::nextToken()
 
 void Tokeniser::skipWhitespace()
 {
-    while (matchRegex(whitespaceRegex)) {
+    while (matchRegex(regexes().whitespaceRegex)) {
         m_iter += m_token.size();
     }
 }
@@ -127,12 +136,22 @@ malValuePtr readStr(const String& input)
     return readForm(tokeniser);
 }
 
+malValuePtr readAll(const String& input)
+{
+    Tokeniser tokeniser(input);
+    std::unique_ptr<malValueVec> forms(new malValueVec);
+    while (!tokeniser.eof()) {
+        forms->push_back(readForm(tokeniser));
+    }
+    return mal::list(forms.release());
+}
+
 static malValuePtr readForm(Tokeniser& tokeniser)
 {
     MAL_CHECK(!tokeniser.eof(), "Expected form, got EOF");
     String token = tokeniser.peek();
 
-    MAL_CHECK(!std::regex_match(token, closeRegex),
+    MAL_CHECK(!std::regex_match(token, regexes().closeRegex),
             "Unexpected \"%s\"", token.c_str());
 
     if (token == "(") {
@@ -151,7 +170,7 @@ static malValuePtr readForm(Tokeniser& tokeniser)
         tokeniser.next();
         malValueVec items;
         readList(tokeniser, &items, "}");
-        return mal::hash(items.begin(), items.end(), false);
+        return mal::hash(beginOf(items), endOf(items), false);
     }
     return readAtom(tokeniser);
 }
@@ -203,7 +222,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
             return processMacro(tokeniser, macro.symbol);
         }
     }
-    if (std::regex_match(token, intRegex)) {
+    if (std::regex_match(token, regexes().intRegex)) {
         return mal::integer(token);
     }
     return mal::symbol(token);
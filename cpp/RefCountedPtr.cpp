@@ -0,0 +1,148 @@
+#include "RefCountedPtr.h"
+
+#include <chrono>
+#include <vector>
+
+bool RefCounted::s_isThreaded = false;
+#ifdef MAL_COUNT_REFS
+std::atomic<int64_t> RefCounted::s_writes(0);
+#endif
+
+namespace {
+
+struct Deferred {
+    Deferred() : isDeleting(false) { }
+
+    std::vector<const RefCounted*> queue; // counts at zero, not yet deleted
+    bool isDeleting;
+};
+
+}
+
+// How much of the queue is deleted along with each object dropped, and
+// with each object made. Only slices of dropped objects which start with
+// more than TimedSlice queued are timed, as anything less is too short to
+// be worth the clock reads.
+static const size_t DisposeSlice = 64;
+static const size_t AllocationSlice = 16;
+static const size_t TimedSlice = 16;
+
+static thread_local Deferred* s_deferred = NULL;
+static thread_local bool s_isThreadExiting = false;
+
+static std::atomic<int64_t> s_deferredCount(0);
+static std::atomic<int64_t> s_longestPauseNs(0);
+
+static void drain(Deferred& d, size_t limit, bool isTimed);
+
+// Deletes whatever this thread still has queued as the thread exits.
+// Objects can still be released after that, while other thread-locals and
+// statics are torn down, and dispose deletes those before it returns.
+struct DeferredOwner {
+    ~DeferredOwner() {
+        s_isThreadExiting = true;
+        if (Deferred* d = s_deferred) {
+            drain(*d, SIZE_MAX, false);
+            s_deferred = NULL;
+            delete d;
+        }
+    }
+};
+
+static thread_local DeferredOwner s_deferredOwner;
+
+// This thread's queue, or NULL once the thread is exiting.
+static Deferred* deferred()
+{
+    if (!s_deferred && !s_isThreadExiting) {
+        (void)&s_deferredOwner; // registers its destructor for this thread
+        s_deferred = new Deferred;
+    }
+    return s_deferred;
+}
+
+static void drain(Deferred& d, size_t limit, bool isTimed)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start;
+    if (isTimed) {
+        start = Clock::now();
+    }
+
+    d.isDeleting = true;
+    size_t deleted = 0;
+    while (!d.queue.empty() && (deleted < limit)) {
+        const RefCounted* object = d.queue.back();
+        d.queue.pop_back();
+        delete object;
+        deleted++;
+    }
+    d.isDeleting = false;
+    s_deferredCount.fetch_add(deleted, std::memory_order_relaxed);
+
+    if (isTimed) {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start).count();
+        int64_t longest = s_longestPauseNs.load(std::memory_order_relaxed);
+        while ((ns > longest) &&
+               !s_longestPauseNs.compare_exchange_weak(longest, ns)) {
+        }
+    }
+}
+
+void RefCounted::dispose(const RefCounted* object)
+{
+    Deferred* d = deferred();
+    if (!d) {
+        // The thread is exiting, so whatever this releases is queued on the
+        // stack, and deleted before returning.
+        Deferred exiting;
+        s_deferred = &exiting;
+        exiting.isDeleting = true;
+        delete object;
+        exiting.isDeleting = false;
+        drain(exiting, SIZE_MAX, false);
+        s_deferred = NULL;
+        return;
+    }
+    if (d->isDeleting) {
+        d->queue.push_back(object);
+        return;
+    }
+    d->isDeleting = true;
+    delete object;
+    d->isDeleting = false;
+    if (!d->queue.empty()) {
+        drain(*d, DisposeSlice, d->queue.size() > TimedSlice);
+    }
+}
+
+void RefCounted::noteAllocation()
+{
+    Deferred* d = s_deferred;
+    if (d && !d->isDeleting && !d->queue.empty()) {
+        drain(*d, AllocationSlice, false);
+    }
+}
+
+bool RefCounted::drainDeferred()
+{
+    Deferred* d = s_deferred;
+    if (!d || d->isDeleting) {
+        return false;
+    }
+    if (!d->queue.empty()) {
+        drain(*d, DisposeSlice, d->queue.size() > TimedSlice);
+    }
+    return !d->queue.empty();
+}
+
+int64_t RefCounted::deferredCount()
+{
+    return s_deferredCount.load();
+}
+
+int64_t RefCounted::longestPauseNs()
+{
+    return s_longestPauseNs.load();
+}
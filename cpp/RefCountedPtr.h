@@ -3,22 +3,111 @@
 
 #include "Debug.h"
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// REFCOUNTS=1 (MAL_COUNT_REFS) counts every write acquire and release make
+// to a count, for --ref-stats.
+#ifdef MAL_COUNT_REFS
+    #define COUNT_REF_WRITE() \
+        RefCounted::s_writes.fetch_add(1, std::memory_order_relaxed)
+#else
+    #define COUNT_REF_WRITE() NOOP
+#endif
 
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
+    RefCounted() : m_refCount(0) { noteAllocation(); }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
-    int refCount() const { return m_refCount; }
+    const RefCounted* acquire() const {
+        int count = refCount();
+        if (count >= Immortal) {
+            return this;
+        }
+        COUNT_REF_WRITE();
+        if (s_isThreaded) {
+            m_refCount.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            m_refCount.store(count + 1, std::memory_order_relaxed);
+        }
+        return this;
+    }
+
+    int release() const {
+        int count = refCount();
+        if (count >= Immortal) {
+            return count;
+        }
+        COUNT_REF_WRITE();
+        if (s_isThreaded) {
+            return m_refCount.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        }
+        m_refCount.store(count - 1, std::memory_order_relaxed);
+        return count - 1;
+    }
+
+    int refCount() const { return m_refCount.load(std::memory_order_relaxed); }
+
+    // Immortal objects are never freed, and acquire and release don't write
+    // to them at all, so pages full of them stay shared after a fork().
+    void makeImmortal() const {
+        m_refCount.store(Immortal, std::memory_order_relaxed);
+    }
+    bool isImmortal() const { return refCount() >= Immortal; }
+
+    // Counts are plain loads and stores until a second thread can see
+    // objects, after which they are atomic read-modify-writes. This must be
+    // called before any other thread is started, and can't be undone.
+    static void enableThreading() { s_isThreaded = true; }
+    static bool isThreaded() { return s_isThreaded; }
+
+    // Deletes an object whose count has dropped to zero. Whatever that
+    // releases in turn goes on a per-thread queue rather than being deleted
+    // recursively, and only a slice of the queue is worked through here.
+    // The rest is deleted a little at a time as new objects are made, so
+    // dropping a big structure neither stalls the caller nor grows the C++
+    // stack with the depth of the structure.
+    static void dispose(const RefCounted* object);
+
+    // Deletes a slice of what this thread has queued, as dispose does, for
+    // when nothing is waiting on it: between REPL lines, server requests
+    // and pool tasks. Returns whether there's any more to delete, so that
+    // the caller can look for new work between slices.
+    static bool drainDeferred();
+
+    // Objects deleted from the queue, and the longest slice of them that
+    // held up evaluation, over all threads.
+    static int64_t deferredCount();
+    static int64_t longestPauseNs();
+
+    // The number of writes to counts so far, or -1 if they aren't counted.
+    static int64_t writeCount() {
+#ifdef MAL_COUNT_REFS
+        return s_writes.load();
+#else
+        return -1;
+#endif
+    }
+
+#ifdef MAL_COUNT_REFS
+    static std::atomic<int64_t> s_writes;
+#endif
 
 private:
+    static const int Immortal = 1 << 30;
+
+    static void noteAllocation();
+
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
-    mutable int m_refCount;
+    mutable std::atomic<int> m_refCount;
+
+    static bool s_isThreaded;
 };
 
 template<class T>
@@ -32,11 +121,20 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    // Moving hands the reference over, so neither count changes.
+    RefCountedPtr(RefCountedPtr&& rhs) : m_object(rhs.m_object)
+    { rhs.m_object = 0; }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) {
+        std::swap(m_object, rhs.m_object);
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -67,7 +165,7 @@ private:
 
     void release() {
         if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+            RefCounted::dispose(m_object);
         }
     }
 
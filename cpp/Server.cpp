@@ -0,0 +1,308 @@
+#include "Server.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+// Anything bigger than this is more likely a confused client than a script.
+static const uint32_t MaxRequestLength = 64 << 20;
+
+struct Connection {
+    Connection(int fd, malEnvPtr root) : fd(fd), session(root) { }
+    ~Connection() { close(fd); }
+
+    int         fd;
+    Interpreter session;
+    String      input;  // bytes received, up to an incomplete request
+    String      output; // replies not yet written
+};
+
+static void appendLength(String& out, uint32_t length)
+{
+    out += char(length >> 24);
+    out += char(length >> 16);
+    out += char(length >> 8);
+    out += char(length);
+}
+
+static uint32_t readLength(const String& in, size_t offset)
+{
+    const unsigned char* p =
+        reinterpret_cast<const unsigned char*>(in.data() + offset);
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16)
+         | (uint32_t(p[2]) << 8)  |  uint32_t(p[3]);
+}
+
+static String evalRequest(Interpreter& session, const String& source)
+{
+    std::ostringstream printed;
+    session.setOutput(printed);
+
+    char status = 0;
+    String result;
+    try {
+        result = session.eval(source)->print(true);
+    }
+    catch (String& s) {
+        status = 1;
+        result = s;
+    }
+    catch (malEmptyInputException&) {
+        result = mal::nilValue()->print(true);
+    }
+    catch (malValuePtr& o) {
+        status = 1;
+        result = o->print(true);
+    };
+    session.setOutput(std::cout);
+
+    String text = printed.str();
+    String reply;
+    appendLength(reply, 1 + 4 + text.size() + result.size());
+    reply += status;
+    appendLength(reply, text.size());
+    reply += text;
+    reply += result;
+    return reply;
+}
+
+// Evaluates every complete request in the input buffer. Returns false if
+// the client sent something unreasonable.
+static bool handleInput(Connection& conn)
+{
+    size_t offset = 0;
+    while (conn.input.size() - offset >= 4) {
+        uint32_t length = readLength(conn.input, offset);
+        if (length > MaxRequestLength) {
+            return false;
+        }
+        if (conn.input.size() - offset - 4 < length) {
+            break;
+        }
+        conn.output += evalRequest(conn.session,
+                                   conn.input.substr(offset + 4, length));
+        offset += 4 + length;
+    }
+    conn.input.erase(0, offset);
+    return true;
+}
+
+// Returns false once the connection is finished with.
+static bool readInput(Connection& conn)
+{
+    char buffer[16384];
+    while (1) {
+        ssize_t count = read(conn.fd, buffer, sizeof(buffer));
+        if (count > 0) {
+            conn.input.append(buffer, count);
+            continue;
+        }
+        if (count == 0) {
+            return false;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+    }
+}
+
+static bool writeOutput(Connection& conn)
+{
+    size_t offset = 0;
+    while (offset < conn.output.size()) {
+        ssize_t count = send(conn.fd, conn.output.data() + offset,
+                             conn.output.size() - offset, MSG_NOSIGNAL);
+        if (count >= 0) {
+            offset += count;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            return false;
+        }
+        break;
+    }
+    conn.output.erase(0, offset);
+    return true;
+}
+
+static int listenOn(const String& socketPath)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    MAL_CHECK(socketPath.size() < sizeof(addr.sun_path),
+              "Socket path too long: %s", socketPath.c_str());
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    MAL_CHECK(fd >= 0, "socket: %s", strerror(errno));
+
+    unlink(socketPath.c_str()); // a stale socket from an earlier server
+    if ((bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) ||
+        (listen(fd, SOMAXCONN) < 0)) {
+        int error = errno;
+        close(fd);
+        MAL_FAIL("Cannot listen on %s: %s", socketPath.c_str(),
+                 strerror(error));
+    }
+    return fd;
+}
+
+#ifdef __linux__
+
+void serve(Interpreter& root, const String& socketPath)
+{
+    int listenFd = listenOn(socketPath);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    MAL_CHECK(epollFd >= 0, "epoll_create1: %s", strerror(errno));
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+    std::map<int, std::unique_ptr<Connection> > connections;
+    epoll_event events[64];
+    while (1) {
+        // Nobody is waiting on us while we wait, so clear up after the
+        // last round of requests now, a slice at a time, polling for new
+        // ones in between.
+        bool isDraining = RefCounted::drainDeferred();
+        int count = epoll_wait(epollFd, events, 64, isDraining ? 0 : -1);
+        if (count < 0) {
+            MAL_CHECK(errno == EINTR, "epoll_wait: %s", strerror(errno));
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd) {
+                int clientFd;
+                while ((clientFd = accept4(listenFd, NULL, NULL,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    connections[clientFd].reset(
+                        new Connection(clientFd, root.env()));
+                    event.events = EPOLLIN;
+                    event.data.fd = clientFd;
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event);
+                }
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) {
+                continue;
+            }
+            Connection& conn = *it->second;
+
+            bool isOpen = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                isOpen = readInput(conn);
+                // Answer whatever arrived, even if the client has now
+                // shut down its side.
+                if (!handleInput(conn)) {
+                    isOpen = false;
+                    conn.output.clear();
+                }
+            }
+            if (!writeOutput(conn)) {
+                isOpen = false;
+                conn.output.clear();
+            }
+
+            if (!isOpen && conn.output.empty()) {
+                connections.erase(it); // closes and forgets the fd
+                continue;
+            }
+            event.events = (isOpen ? EPOLLIN : 0)
+                         | (conn.output.empty() ? 0 : EPOLLOUT);
+            event.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+        }
+    }
+}
+
+#else
+
+void serve(Interpreter& root, const String& socketPath)
+{
+    MAL_FAIL("--serve needs epoll, which this platform doesn't have");
+}
+
+#endif
+
+// The child's side of forkScripts. This never returns.
+static void runScript(Interpreter& root, const String& script)
+{
+    int status = 0;
+    try {
+        root.eval(STRF("(load-file %s)", escape(script).c_str()));
+    }
+    catch (String& s) {
+        std::cerr << script << ": " << s << "\n";
+        status = 1;
+    }
+    catch (malEmptyInputException&) {
+    }
+    catch (malValuePtr& o) {
+        std::cerr << script << ": " << o->print(true) << "\n";
+        status = 1;
+    };
+    std::cout.flush();
+    std::cerr.flush();
+    _exit(status);
+}
+
+int forkScripts(Interpreter& root, const StringVec& scripts)
+{
+    MAL_CHECK(!RefCounted::isThreaded(),
+              "Can't fork once futures have started threads");
+
+    int failures = 0;
+    for (auto& script : scripts) {
+        using namespace std::chrono;
+        auto start = steady_clock::now();
+
+        std::cout.flush(); // or the child would print it again
+        pid_t pid = fork();
+        MAL_CHECK(pid >= 0, "fork: %s", strerror(errno));
+        if (pid == 0) {
+            runScript(root, script);
+        }
+
+        int status;
+        rusage usage;
+        while (wait4(pid, &status, 0, &usage) < 0) {
+            MAL_CHECK(errno == EINTR, "wait4: %s", strerror(errno));
+        }
+        auto wall = duration_cast<microseconds>(steady_clock::now() - start);
+
+        int exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        if (exitCode != 0) {
+            failures++;
+        }
+        std::cerr << STRF("fork-server: %s status=%d wall_us=%lld "
+                          "maxrss_kb=%ld minflt=%ld\n",
+                          script.c_str(), exitCode,
+                          (long long)wall.count(),
+                          usage.ru_maxrss, usage.ru_minflt);
+    }
+    return failures;
+}
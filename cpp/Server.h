@@ -0,0 +1,28 @@
+#ifndef INCLUDE_SERVER_H
+#define INCLUDE_SERVER_H
+
+#include "Interpreter.h"
+
+// Serves eval requests on a Unix domain socket, for `stepA_mal --serve`.
+// Every connection gets its own session: a child environment of root, so
+// the warmed-up prelude is shared but definitions are not.
+//
+// A request is a 4-byte big-endian length followed by that much mal source.
+// The reply is a 4-byte big-endian length followed by:
+//   1 byte   0 if the source evaluated, 1 if it threw
+//   4 bytes  big-endian length of the text printed while evaluating
+//   ...      the printed text
+//   ...      the result printed readably, or the error
+//
+// Requests are evaluated one at a time on the calling thread, and this
+// only returns by throwing if the socket can't be set up.
+void serve(Interpreter& root, const String& socketPath);
+
+// Runs each script in its own fork()ed child of root, one after another,
+// so that the children share root's heap copy-on-write. Freeze root's
+// environment first, or the refcount updates will copy most of it anyway.
+// A line giving each child's exit status, wall time, peak RSS and page
+// faults goes to stderr. Returns the number of scripts which failed.
+int forkScripts(Interpreter& root, const StringVec& scripts);
+
+#endif // INCLUDE_SERVER_H
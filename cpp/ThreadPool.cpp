@@ -0,0 +1,116 @@
+#include "ThreadPool.h"
+#include "RefCountedPtr.h"
+
+#include <stdlib.h>
+
+// Index of the pool worker running on this thread, or -1.
+static thread_local int s_workerIndex = -1;
+
+static int poolSize()
+{
+    RefCounted::enableThreading();
+    int count = std::thread::hardware_concurrency();
+    if (const char* threads = getenv("MAL_THREADS")) {
+        count = atoi(threads);
+    }
+    return count > 0 ? count : 1;
+}
+
+ThreadPool& ThreadPool::instance()
+{
+    // Destroyed as the process exits, which joins the workers before the
+    // statics they might use are torn down.
+    static ThreadPool pool(poolSize());
+    return pool;
+}
+
+ThreadPool::ThreadPool(int threadCount)
+: m_nextWorker(0)
+, m_queued(0)
+, m_isStopping(false)
+{
+    for (int i = 0; i < threadCount; i++) {
+        m_workers.emplace_back(new Worker);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        m_threads.emplace_back(&ThreadPool::run, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_idleLock);
+        m_isStopping = true;
+    }
+    m_idle.notify_all();
+    for (auto& thread : m_threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::submit(Task task)
+{
+    int index = s_workerIndex;
+    if (index < 0) {
+        index = m_nextWorker++ % m_workers.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_workers[index]->lock);
+        m_workers[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_idleLock);
+        m_queued++;
+    }
+    m_idle.notify_one();
+}
+
+bool ThreadPool::popTask(int index, Task& task)
+{
+    Worker& worker = *m_workers[index];
+    std::lock_guard<std::mutex> lock(worker.lock);
+    if (worker.tasks.empty()) {
+        return false;
+    }
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::stealTask(int index, Task& task)
+{
+    int count = m_workers.size();
+    for (int i = 1; i < count; i++) {
+        Worker& victim = *m_workers[(index + i) % count];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(int index)
+{
+    s_workerIndex = index;
+    while (1) {
+        if (m_isStopping) {
+            return;
+        }
+        Task task;
+        if (popTask(index, task) || stealTask(index, task)) {
+            m_queued--;
+            task();
+            continue;
+        }
+
+        if (RefCounted::drainDeferred()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_idleLock);
+        m_idle.wait(lock, [this] { return (m_queued > 0) || m_isStopping; });
+    }
+}
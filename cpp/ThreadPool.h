@@ -0,0 +1,53 @@
+#ifndef INCLUDE_THREADPOOL_H
+#define INCLUDE_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A work-stealing pool with one thread per core, or $MAL_THREADS if set.
+// Each worker has its own deque: it pushes and pops work at the back, and
+// idle workers steal from the front of the others. Work submitted from outside the pool is spread
+// across the workers in turn.
+class ThreadPool {
+public:
+    typedef std::function<void ()> Task;
+
+    // The pool is created on first use, which also switches reference
+    // counting into its thread-safe mode.
+    static ThreadPool& instance();
+
+    // Waits for the workers to finish the tasks they're running, and then
+    // for them to exit. Tasks which haven't been started are dropped.
+    ~ThreadPool();
+
+    void submit(Task task);
+    int threadCount() const { return m_workers.size(); }
+
+private:
+    ThreadPool(int threadCount);
+
+    struct Worker {
+        std::mutex       lock;
+        std::deque<Task> tasks;
+    };
+
+    void run(int index);
+    bool popTask(int index, Task& task);
+    bool stealTask(int index, Task& task);
+
+    std::vector<std::unique_ptr<Worker> > m_workers;
+    std::vector<std::thread> m_threads;
+    std::atomic<unsigned> m_nextWorker;
+    std::atomic<int>      m_queued;
+    std::atomic<bool>     m_isStopping; // set with m_idleLock held
+    std::mutex              m_idleLock;
+    std::condition_variable m_idle;
+};
+
+#endif // INCLUDE_THREADPOOL_H
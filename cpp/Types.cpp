@@ -1,11 +1,77 @@
+#include "ArgStack.h"
 #include "Debug.h"
 #include "Environment.h"
+#include "Jit.h"
+#include "ThreadPool.h"
 #include "Types.h"
 
 #include <algorithm>
 #include <memory>
+#include <thread>
 #include <typeinfo>
 
+// Allocates a list or vector of count nils in one block, the items
+// straight after the object. Callers fill them in before it's shared.
+template <class T>
+static T* allocateSequence(int count, malValuePtr meta = NULL)
+{
+    static_assert(sizeof(T) % alignof(malValuePtr) == 0,
+                  "the items must be aligned");
+    void* block = ::operator new(sizeof(T) + count * sizeof(malValuePtr));
+    malValuePtr* items = reinterpret_cast<malValuePtr*>(
+        static_cast<char*>(block) + sizeof(T));
+    std::uninitialized_fill_n(items, count, malValuePtr());
+    return new (block) T(items, count, meta);
+}
+
+// Allocates a record of shape, its slots nil, in the same way.
+static malRecord* allocateRecord(malValuePtr shape, malValuePtr meta = NULL)
+{
+    static_assert(sizeof(malRecord) % alignof(malValuePtr) == 0,
+                  "the slots must be aligned");
+    int count = STATIC_CAST(malShape, shape)->count();
+    void* block = ::operator new(sizeof(malRecord)
+                                 + count * sizeof(malValuePtr));
+    malValuePtr* slots = reinterpret_cast<malValuePtr*>(
+        static_cast<char*>(block) + sizeof(malRecord));
+    std::uninitialized_fill_n(slots, count, malValuePtr());
+    return new (block) malRecord(shape, slots, meta);
+}
+
+// Mixes value into a hash of the values before it.
+static size_t combineHash(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+// Whether two collections of count items might be equal, judging by their
+// hashes. Small ones are about as quick to compare as to hash. Bigger ones
+// keep their hashes once they've been worked out, so telling them apart
+// from anything they're compared with again takes no walk at all.
+static bool mightBeEqual(const malValue* lhs, const malValue* rhs, int count)
+{
+    return (count < 16) || (lhs->hash() == rhs->hash());
+}
+
+template <class T>
+static malValuePtr copySequence(malValueIter begin, malValueIter end,
+                                malValuePtr meta = NULL)
+{
+    T* seq = allocateSequence<T>(end - begin, meta);
+    std::copy(begin, end, seq->begin());
+    return malValuePtr(seq);
+}
+
+// As copySequence, for items which are about to be thrown away, so their
+// references can be moved rather than counted up and down again.
+template <class T>
+static malValuePtr moveSequence(malValueIter begin, malValueIter end)
+{
+    T* seq = allocateSequence<T>(end - begin);
+    std::move(begin, end, seq->begin());
+    return malValuePtr(seq);
+}
+
 namespace mal {
     malValuePtr atom(malValuePtr value) {
         return malValuePtr(new malAtom(value));
@@ -19,16 +85,46 @@ namespace mal {
         return malValuePtr(new malBuiltIn(name, handler));
     };
 
+    malValuePtr compiledFn(malCompiledFn::Code code, malEnvPtr env,
+                           const malValueVec& captures) {
+        return malValuePtr(new malCompiledFn(code, env, captures));
+    }
+
+    malValuePtr dispatchSite(malValuePtr form, malValuePtr fn) {
+        return malValuePtr(new malDispatchSite(form, fn));
+    }
+
     malValuePtr falseValue() {
         static malValuePtr c(new malConstant("false"));
         return malValuePtr(c);
     };
 
+    malValuePtr fieldSite(malValuePtr form, malValuePtr target,
+                          malValuePtr key, malValuePtr value) {
+        return malValuePtr(new malFieldSite(form, target, key, value));
+    }
+
+    malValuePtr fnForm(malValuePtr form, const StringVec& params,
+                       const StringVec& captures, int depth) {
+        return malValuePtr(new malFnForm(form, params, captures, depth));
+    }
+
+    malValuePtr folded(malValuePtr form, malValuePtr value) {
+        return malValuePtr(new malFolded(form, value));
+    }
+
+    malValuePtr future(malFuture::Body body) {
+        return malValuePtr(new malFuture(body));
+    }
 
     malValuePtr hash(const malHash::Map& map) {
         return malValuePtr(new malHash(map));
     }
 
+    malValuePtr hash(malHash::Map&& map) {
+        return malValuePtr(new malHash(std::move(map)));
+    }
+
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated) {
         return malValuePtr(new malHash(argsBegin, argsEnd, isEvaluated));
@@ -52,222 +148,1560 @@ namespace mal {
     }
 
     malValuePtr list(malValueVec* items) {
-        return malValuePtr(new malList(items));
+        std::unique_ptr<malValueVec> owned(items);
+        return moveSequence<malList>(beginOf(*items), endOf(*items));
     };
 
     malValuePtr list(malValueIter begin, malValueIter end) {
-        return malValuePtr(new malList(begin, end));
+        return copySequence<malList>(begin, end);
+    };
+
+    malValuePtr list(malValuePtr a) {
+        malValuePtr items[] = { std::move(a) };
+        return moveSequence<malList>(items, items + 1);
+    }
+
+    malValuePtr list(malValuePtr a, malValuePtr b) {
+        malValuePtr items[] = { std::move(a), std::move(b) };
+        return moveSequence<malList>(items, items + 2);
+    }
+
+    malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c) {
+        malValuePtr items[] = { std::move(a), std::move(b), std::move(c) };
+        return moveSequence<malList>(items, items + 3);
+    }
+
+    malValuePtr listTemplate(malValuePtr form,
+                             const malTemplate::Parts& parts) {
+        return malValuePtr(new malTemplate(form, parts));
+    }
+
+    malValuePtr macro(const malLambda& lambda) {
+        return malValuePtr(new malLambda(lambda, true));
+    };
+
+    malValuePtr memo(malValuePtr fn, int64_t capacity) {
+        return malValuePtr(new malMemo(fn, capacity));
+    }
+
+    malValuePtr nilValue() {
+        static malValuePtr c(new malConstant("nil"));
+        return malValuePtr(c);
+    };
+
+    malValuePtr protocol(const String& name,
+                         malValueIter methodsBegin, malValueIter methodsEnd) {
+        return malValuePtr(new malProtocol(name, methodsBegin, methodsEnd));
+    }
+
+    malValuePtr protocolFn(malValuePtr protocol, int method) {
+        return malValuePtr(new malProtocolFn(protocol, method));
+    }
+
+    malValuePtr record(malValuePtr shape,
+                       malValueIter valuesBegin, malValueIter valuesEnd) {
+        malRecord* record = allocateRecord(shape);
+        malValuePtr result(record);
+        MAL_CHECK(std::distance(valuesBegin, valuesEnd)
+                      == record->shape()->count(),
+                  "record of %s needs %d values",
+                  shape->print(true).c_str(), record->shape()->count());
+        std::copy(valuesBegin, valuesEnd, record->begin());
+        return result;
+    }
+
+    malValuePtr shape(malValueIter keysBegin, malValueIter keysEnd) {
+        return malValuePtr(new malShape(keysBegin, keysEnd));
+    }
+
+    malValuePtr string(const String& token) {
+        return malValuePtr(new malString(token));
+    }
+
+    malValuePtr symbol(const String& token) {
+        return malValuePtr(new malSymbol(token));
+    };
+
+    malValuePtr transient(malValuePtr collection) {
+        if (const malVector* vector = DYNAMIC_CAST(malVector, collection)) {
+            return malValuePtr(new malTransient(vector));
+        }
+        const malHash* hash = DYNAMIC_CAST(malHash, collection);
+        MAL_CHECK(hash, "%s is not a vector or map",
+                  collection->print(true).c_str());
+        return malValuePtr(new malTransient(hash));
+    }
+
+    malValuePtr trueValue() {
+        static malValuePtr c(new malConstant("true"));
+        return malValuePtr(c);
+    };
+
+    malValuePtr vector(malValueVec* items) {
+        std::unique_ptr<malValueVec> owned(items);
+        return moveSequence<malVector>(beginOf(*items), endOf(*items));
+    };
+
+    malValuePtr vector(malValueIter begin, malValueIter end) {
+        return copySequence<malVector>(begin, end);
+    };
+};
+
+malAtom::malAtom(malValuePtr value)
+: m_value(value.ptr())
+, m_readers(0)
+, m_swaps(0)
+, m_retries(0)
+{
+    value->acquire();
+}
+
+malAtom::malAtom(const malAtom& that, malValuePtr meta)
+: malValue(meta)
+, m_value(NULL)
+, m_readers(0)
+, m_swaps(0)
+, m_retries(0)
+{
+    malValuePtr value = that.deref();
+    value->acquire();
+    m_value = value.ptr();
+}
+
+malAtom::~malAtom()
+{
+    retire(m_value.load());
+}
+
+malValuePtr malAtom::deref() const
+{
+    if (!RefCounted::isThreaded()) {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+    m_readers++;
+    malValuePtr value = m_value.load();
+    m_readers--;
+    return value;
+}
+
+malValuePtr malAtom::reset(malValuePtr value)
+{
+    value->acquire();
+    malValue* oldValue = m_value.exchange(value.ptr());
+    malValuePtr result = oldValue;
+    retire(oldValue);
+    return result;
+}
+
+bool malAtom::compareAndSet(malValuePtr expected, malValuePtr value)
+{
+    malValue* current = expected.ptr();
+    value->acquire();
+    if (!m_value.compare_exchange_strong(current, value.ptr())) {
+        value->release(); // we still hold value, so this isn't the last ref
+        return false;
+    }
+    retire(current);
+    return true;
+}
+
+malValuePtr malAtom::swap(malValuePtr op, malValueIter argsBegin,
+                          malValueIter argsEnd, malValuePtr& newValue)
+{
+    ArgStack::Frame args(1 + argsEnd - argsBegin);
+    std::copy(argsBegin, argsEnd, args.begin() + 1);
+
+    m_swaps++;
+    while (1) {
+        malValuePtr oldValue = deref();
+        args[0] = oldValue;
+        newValue = APPLY(op, args.begin(), args.end());
+        if (compareAndSet(oldValue, newValue)) {
+            return oldValue;
+        }
+        m_retries++;
+    }
+}
+
+void malAtom::retire(malValue* value)
+{
+    // Wait until nobody can be between loading value and acquiring it.
+    while (m_readers.load() != 0) {
+        std::this_thread::yield();
+    }
+    if (value->release() == 0) {
+        RefCounted::dispose(value);
+    }
+}
+
+void malAtom::freezeChildren()
+{
+    deref()->freeze();
+}
+
+void malAtom::addWatch(malValuePtr key, malValuePtr fn)
+{
+    std::lock_guard<std::mutex> lock(m_watchLock);
+    for (auto it = m_watches.begin(); it != m_watches.end(); it += 2) {
+        if (key->isEqualTo(it->ptr())) {
+            *(it + 1) = fn;
+            return;
+        }
+    }
+    m_watches.push_back(key);
+    m_watches.push_back(fn);
+}
+
+void malAtom::removeWatch(malValuePtr key)
+{
+    std::lock_guard<std::mutex> lock(m_watchLock);
+    for (auto it = m_watches.begin(); it != m_watches.end(); it += 2) {
+        if (key->isEqualTo(it->ptr())) {
+            m_watches.erase(it, it + 2);
+            return;
+        }
+    }
+}
+
+void malAtom::notifyWatches(malValuePtr oldValue, malValuePtr newValue)
+{
+    malValueVec watches;
+    {
+        std::lock_guard<std::mutex> lock(m_watchLock);
+        if (m_watches.empty()) {
+            return;
+        }
+        watches = m_watches;
+    }
+
+    malValueVec args(4);
+    args[1] = this;
+    args[2] = oldValue;
+    args[3] = newValue;
+    for (auto it = watches.begin(); it != watches.end(); it += 2) {
+        args[0] = *it;
+        APPLY(*(it + 1), beginOf(args), endOf(args));
+    }
+}
+
+static malBuiltIn::InlineOp inlineOpFor(const String& name)
+{
+    static const std::map<String, malBuiltIn::InlineOp> ops = {
+        { "+",  malBuiltIn::Add },
+        { "-",  malBuiltIn::Sub },
+        { "*",  malBuiltIn::Mul },
+        { "/",  malBuiltIn::Div },
+        { "%",  malBuiltIn::Mod },
+        { "<=", malBuiltIn::LessEqual },
+        { "=",  malBuiltIn::Equal },
     };
+    auto it = ops.find(name);
+    return it != ops.end() ? it->second : malBuiltIn::NotInline;
+}
+
+malBuiltIn::malBuiltIn(const String& name, ApplyFunc* handler)
+: m_name(name)
+, m_handler(handler)
+, m_inlineOp(inlineOpFor(name))
+{
+
+}
+
+malValuePtr malBuiltIn::apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const
+{
+    return m_handler(m_name, argsBegin, argsEnd);
+}
+
+malValuePtr malBuiltIn::applyInline(const malValuePtr& lhs,
+                                    const malValuePtr& rhs) const
+{
+    const malInteger* a = DYNAMIC_CAST(malInteger, lhs);
+    const malInteger* b = DYNAMIC_CAST(malInteger, rhs);
+    if (a && b) {
+        int64_t x = a->value(), y = b->value();
+        switch (m_inlineOp) {
+            case Add:       return mal::integer(x + y);
+            case Sub:       return mal::integer(x - y);
+            case Mul:       return mal::integer(x * y);
+            case Div:       if (y != 0) return mal::integer(x / y); break;
+            case Mod:       if (y != 0) return mal::integer(x % y); break;
+            case LessEqual: return mal::boolean(x <= y);
+            case Equal:     return mal::boolean(x == y);
+            case NotInline: break;
+        }
+    }
+    // Anything else, including the errors, is the builtin's business.
+    malValuePtr args[] = { lhs, rhs };
+    return m_handler(m_name, args, args + 2);
+}
+
+static bool holdsAtom(const malValuePtr& value)
+{
+    if (DYNAMIC_CAST(malAtom, value) || DYNAMIC_CAST(malTransient, value)) {
+        return true;
+    }
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, value)) {
+        return std::any_of(seq->begin(), seq->end(), holdsAtom);
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, value)) {
+        return holdsAtom(hash->values());
+    }
+    return false;
+}
+
+malMemo::malMemo(malValuePtr fn, int64_t capacity)
+: m_fn(fn)
+, m_table(std::make_shared<Table>(capacity))
+{
+
+}
+
+malMemo::malMemo(const malMemo& that, malValuePtr meta)
+: malApplicable(meta)
+, m_fn(that.m_fn)
+, m_table(that.m_table)
+{
+
+}
+
+malValuePtr malMemo::apply(malValueIter argsBegin,
+                           malValueIter argsEnd) const
+{
+    size_t hash = malSequence::hashItems(argsBegin, argsEnd);
+    {
+        std::lock_guard<std::mutex> guard(m_table->lock);
+        auto it = m_table->find(hash, argsBegin, argsEnd);
+        if (it != m_table->entries.end()) {
+            m_table->hits++;
+            return it->result;
+        }
+        m_table->misses++;
+    }
+
+    malValuePtr args = mal::list(argsBegin, argsEnd);
+    const malList* list = STATIC_CAST(malList, args);
+    malValuePtr result = APPLY(m_fn, list->begin(), list->end());
+
+    // Atoms can change after the call, so results for arguments which
+    // hold one aren't kept.
+    if (!holdsAtom(args)) {
+        std::lock_guard<std::mutex> guard(m_table->lock);
+        if (m_table->find(hash, list->begin(), list->end()) ==
+            m_table->entries.end()) {
+            m_table->add(hash, args, result);
+        }
+    }
+    return result;
+}
+
+malMemo::Entries::iterator malMemo::Table::find(size_t hash,
+    malValueIter argsBegin, malValueIter argsEnd)
+{
+    auto range = index.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        const malList* args = STATIC_CAST(malList, it->second->args);
+        if ((args->count() == argsEnd - argsBegin) &&
+            std::equal(argsBegin, argsEnd, args->begin(),
+                       [](const malValuePtr& a, const malValuePtr& b) {
+                           return a->isEqualTo(b.ptr());
+                       })) {
+            if (capacity != 0) {
+                entries.splice(entries.begin(), entries, it->second);
+            }
+            return it->second;
+        }
+    }
+    return entries.end();
+}
+
+void malMemo::Table::add(size_t hash, malValuePtr args, malValuePtr result)
+{
+    entries.push_front(Entry { hash, args, result });
+    index.insert(std::make_pair(hash, entries.begin()));
+    if ((capacity == 0) || (int64_t(entries.size()) <= capacity)) {
+        return;
+    }
+
+    auto oldest = std::prev(entries.end());
+    auto range = index.equal_range(oldest->hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == oldest) {
+            index.erase(it);
+            break;
+        }
+    }
+    entries.erase(oldest);
+    evictions++;
+}
+
+int64_t malMemo::hitCount() const
+{
+    std::lock_guard<std::mutex> guard(m_table->lock);
+    return m_table->hits;
+}
+
+int64_t malMemo::missCount() const
+{
+    std::lock_guard<std::mutex> guard(m_table->lock);
+    return m_table->misses;
+}
+
+int64_t malMemo::evictionCount() const
+{
+    std::lock_guard<std::mutex> guard(m_table->lock);
+    return m_table->evictions;
+}
+
+int64_t malMemo::size() const
+{
+    std::lock_guard<std::mutex> guard(m_table->lock);
+    return m_table->entries.size();
+}
+
+void malMemo::freezeChildren()
+{
+    m_fn->freeze();
+    std::lock_guard<std::mutex> guard(m_table->lock);
+    for (auto it = m_table->entries.begin(), end = m_table->entries.end();
+         it != end; ++it) {
+        it->args->freeze();
+        it->result->freeze();
+    }
+}
+
+malFuture::malFuture(Body body)
+: m_shared(new Shared(body))
+{
+    std::shared_ptr<Shared> shared = m_shared;
+    ThreadPool::instance().submit([shared] {
+        if (shared->claim()) {
+            shared->run();
+        }
+    });
+}
+
+malFuture::malFuture(const malFuture& that, malValuePtr meta)
+: malValue(meta)
+, m_shared(that.m_shared)
+{
+
+}
+
+malValuePtr malFuture::deref()
+{
+    if (m_shared->claim()) {
+        m_shared->run();
+    }
+
+    std::unique_lock<std::mutex> lock(m_shared->lock);
+    m_shared->done.wait(lock, [this] { return m_shared->state == Done; });
+    if (m_shared->error) {
+        std::rethrow_exception(m_shared->error);
+    }
+    return m_shared->value;
+}
+
+bool malFuture::isDone() const
+{
+    std::lock_guard<std::mutex> lock(m_shared->lock);
+    return m_shared->state == Done;
+}
+
+bool malFuture::Shared::claim()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (state != Pending) {
+        return false;
+    }
+    state = Running;
+    return true;
+}
+
+void malFuture::Shared::run()
+{
+    malValuePtr result;
+    std::exception_ptr exception;
+    try {
+        result = body();
+    }
+    catch (...) {
+        exception = std::current_exception();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        value = result;
+        error = exception;
+        state = Done;
+        body = nullptr; // drop anything the body captured
+    }
+    done.notify_all();
+}
+
+std::atomic<int> malFolded::s_epoch(0);
+
+malFolded::malFolded(malValuePtr form, malValuePtr value)
+: m_form(form)
+, m_value(value)
+, m_epoch(s_epoch.load())
+{
+
+}
+
+malFolded::malFolded(const malFolded& that, malValuePtr meta)
+: malValue(meta)
+, m_form(that.m_form)
+, m_value(that.m_value)
+, m_epoch(that.m_epoch)
+{
+
+}
+
+malValuePtr malFolded::eval(const malEnvPtr& env)
+{
+    if (s_epoch.load(std::memory_order_relaxed) == m_epoch) {
+        return m_value;
+    }
+    return EVAL(m_form, env);
+}
+
+bool malFolded::isFoldable(const String& name)
+{
+    // The names inlineOpFor knows, without looking them up in its map.
+    if (name.length() == 1) {
+        char c = name[0];
+        return (c == '+') || (c == '-') || (c == '*') || (c == '/') ||
+               (c == '%') || (c == '=');
+    }
+    return name == "<=";
+}
+
+void malFolded::freezeChildren()
+{
+    m_form->freeze();
+    m_value->freeze();
+}
+
+malFnForm::malFnForm(malValuePtr form, const StringVec& params,
+                     const StringVec& captures, int depth)
+: m_form(form)
+, m_params(params)
+, m_captures(captures)
+, m_depth(depth)
+{
+
+}
+
+malFnForm::malFnForm(const malFnForm& that, malValuePtr meta)
+: malValue(meta)
+, m_form(that.m_form)
+, m_params(that.m_params)
+, m_captures(that.m_captures)
+, m_depth(that.m_depth)
+{
+
+}
+
+malValuePtr malFnForm::eval(const malEnvPtr& env)
+{
+    // If a local has yet to be bound after all, which takes a def! which
+    // only a macro expansion shows, the lambda keeps the whole env.
+    malEnvPtr captured = env->capture(m_captures, m_depth);
+    const malList* form = STATIC_CAST(malList, m_form);
+    return mal::lambda(m_params, form->item(2), captured ? captured : env);
+}
+
+void malFnForm::freezeChildren()
+{
+    m_form->freeze();
+}
+
+malTemplate::malTemplate(malValuePtr form, const Parts& parts)
+: m_form(form)
+, m_parts(parts)
+, m_evaluated(0)
+{
+    for (auto it = m_parts.begin(), end = m_parts.end(); it != end; ++it) {
+        if (it->kind != Constant) {
+            m_evaluated++;
+        }
+    }
+}
+
+malTemplate::malTemplate(const malTemplate& that, malValuePtr meta)
+: malValue(meta)
+, m_form(that.m_form)
+, m_parts(that.m_parts)
+, m_evaluated(that.m_evaluated)
+{
+
+}
+
+malValuePtr malTemplate::eval(const malEnvPtr& env)
+{
+    // Evaluate the unquoted forms in order first, so that the count is
+    // known and the list can be allocated once.
+    ArgStack::Frame values(m_evaluated);
+    int count = 0;
+    int slot = 0;
+    for (auto it = m_parts.begin(), end = m_parts.end(); it != end; ++it) {
+        if (it->kind == Constant) {
+            count++;
+            continue;
+        }
+        malValuePtr& value = values[slot++];
+        value = EVAL(it->value, env);
+        count += (it->kind == Splice) ? VALUE_CAST(malSequence, value)->count()
+                                      : 1;
+    }
+
+    malList* list = allocateSequence<malList>(count);
+    malValuePtr result(list);
+    malValueIter out = list->begin();
+    slot = 0;
+    for (auto it = m_parts.begin(), end = m_parts.end(); it != end; ++it) {
+        if (it->kind == Constant) {
+            *out++ = it->value;
+        }
+        else if (it->kind == Unquote) {
+            *out++ = std::move(values[slot++]);
+        }
+        else {
+            const malSequence* seq = STATIC_CAST(malSequence, values[slot++]);
+            out = std::copy(seq->begin(), seq->end(), out);
+        }
+    }
+    return result;
+}
+
+void malTemplate::freezeChildren()
+{
+    m_form->freeze();
+    for (auto it = m_parts.begin(), end = m_parts.end(); it != end; ++it) {
+        it->value->freeze();
+    }
+}
+
+static String makeHashKey(malValuePtr key)
+{
+    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
+        return skey->print(true);
+    }
+    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
+        return kkey->print(true);
+    }
+    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+}
+
+static malHash::Map& addToMap(malHash::Map& map,
+    malValueIter argsBegin, malValueIter argsEnd)
+{
+    // This is intended to be called with pre-evaluated arguments.
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        String key = makeHashKey(*it++);
+        map[key] = *it;
+    }
+
+    return map;
+}
+
+static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "hash-map requires an even-sized list");
+
+    malHash::Map map;
+    return addToMap(map, argsBegin, argsEnd);
+}
+
+malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
+: m_map(createMap(argsBegin, argsEnd))
+, m_isEvaluated(isEvaluated)
+, m_literal(Unknown)
+, m_hash(0)
+{
+
+}
+
+malHash::malHash(const malHash::Map& map)
+: m_map(map)
+, m_isEvaluated(true)
+, m_literal(Unknown)
+, m_hash(0)
+{
+
+}
+
+malHash::malHash(malHash::Map&& map)
+: m_map(std::move(map))
+, m_isEvaluated(true)
+, m_literal(Unknown)
+, m_hash(0)
+{
+
+}
+
+malValuePtr
+malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    malHash::Map map(m_map);
+    return mal::hash(addToMap(map, argsBegin, argsEnd));
+}
+
+bool malHash::contains(malValuePtr key) const
+{
+    auto it = m_map.find(makeHashKey(key));
+    return it != m_map.end();
+}
+
+malValuePtr
+malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    malHash::Map map(m_map);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        String key = makeHashKey(*it);
+        map.erase(key);
+    }
+    return mal::hash(map);
+}
+
+malValuePtr malHash::eval(const malEnvPtr& env)
+{
+    if (isLiteral()) {
+        return malValuePtr(this);
+    }
+
+    malHash::Map map;
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        map[it->first] = EVAL(it->second, env);
+    }
+    return mal::hash(map);
+}
+
+bool malHash::isLiteral() const
+{
+    if (m_isEvaluated) {
+        return true;
+    }
+    if (m_meta) {
+        return false; // evaluating it drops the metadata
+    }
+    Literal literal = m_literal.load(std::memory_order_relaxed);
+    if (literal == Unknown) {
+        literal = Yes;
+        for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+            if (!it->second->isLiteral()) {
+                literal = No;
+                break;
+            }
+        }
+        m_literal.store(literal, std::memory_order_relaxed);
+    }
+    return literal == Yes;
+}
+
+malValuePtr malHash::get(malValuePtr key) const
+{
+    auto it = m_map.find(makeHashKey(key));
+    return it == m_map.end() ? mal::nilValue() : it->second;
+}
+
+malValuePtr malHash::keyOf(const String& hashKey)
+{
+    if (hashKey[0] == '"') {
+        return mal::string(unescape(hashKey));
+    }
+    return mal::keyword(hashKey);
+}
+
+malValuePtr malHash::keys() const
+{
+    malValueVec* keys = new malValueVec();
+    keys->reserve(m_map.size());
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        keys->push_back(keyOf(it->first));
+    }
+    return mal::list(keys);
+}
+
+malValuePtr malHash::values() const
+{
+    malValueVec* keys = new malValueVec();
+    keys->reserve(m_map.size());
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        keys->push_back(it->second);
+    }
+    return mal::list(keys);
+}
+
+String malHash::print(bool readably) const
+{
+    String s = "{";
+
+    auto it = m_map.begin(), end = m_map.end();
+    if (it != end) {
+        s += it->first + " " + it->second->print(readably);
+        ++it;
+    }
+    for ( ; it != end; ++it) {
+        s += " " + it->first + " " + it->second->print(readably);
+    }
+
+    return s + "}";
+}
+
+static bool mapsEqual(const malHash::Map& l_map, const malHash::Map& r_map)
+{
+    if (l_map.size() != r_map.size()) {
+        return false;
+    }
+
+    for (auto it0 = l_map.begin(), end0 = l_map.end(), it1 = r_map.begin();
+         it0 != end0; ++it0, ++it1) {
+
+        if (it0->first != it1->first) {
+            return false;
+        }
+        if (!it0->second->isEqualTo(it1->second.ptr())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool malHash::doIsEqualTo(const malValue* rhs) const
+{
+    if (const malRecord* record = dynamic_cast<const malRecord*>(rhs)) {
+        return record->doIsEqualTo(this);
+    }
+    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
+    return (m_map.size() == r_map.size()) &&
+           mightBeEqual(this, rhs, m_map.size()) && mapsEqual(m_map, r_map);
+}
+
+size_t malHash::hash() const
+{
+    size_t hash = m_hash.load(std::memory_order_relaxed);
+    if (hash == 0) {
+        hash = computeHash();
+        m_hash.store(hash, std::memory_order_relaxed);
+    }
+    return hash;
+}
+
+size_t malHash::computeHash() const
+{
+    size_t result = m_map.size();
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        result = combineHash(result, std::hash<String>()(it->first));
+        result = combineHash(result, it->second->hash());
+    }
+    return result;
+}
+
+void malHash::freezeChildren()
+{
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        it->second->freeze();
+    }
+}
+
+std::atomic<uint32_t> malShape::s_nextId(1);
+
+malShape::malShape(malValueIter keysBegin, malValueIter keysEnd)
+: m_id(s_nextId++)
+{
+    for (auto it = keysBegin; it != keysEnd; ++it) {
+        MAL_CHECK(DYNAMIC_CAST(malKeyword, *it),
+                  "%s is not a keyword", (*it)->print(true).c_str());
+        String key = makeHashKey(*it);
+        MAL_CHECK(m_slots.count(key) == 0, "%s is repeated", key.c_str());
+        m_slots[key] = m_keys.size();
+        m_keys.push_back(key);
+    }
+    for (auto it = m_slots.begin(), end = m_slots.end(); it != end; ++it) {
+        m_sorted.push_back(it->second);
+    }
+}
+
+malShape::malShape(const malShape& that, malValuePtr meta)
+: malValue(meta)
+, m_keys(that.m_keys)
+, m_slots(that.m_slots)
+, m_sorted(that.m_sorted)
+, m_id(that.m_id)
+{
+
+}
+
+String malShape::print(bool readably) const
+{
+    String s = "#shape(";
+    for (auto it = m_keys.begin(), end = m_keys.end(); it != end; ++it) {
+        if (it != m_keys.begin()) {
+            s += " ";
+        }
+        s += *it;
+    }
+    return s + ")";
+}
+
+malRecord::malRecord(malValuePtr shape, malValuePtr* slots, malValuePtr meta)
+: malHash(meta)
+, m_shapeValue(shape)
+, m_shape(STATIC_CAST(malShape, shape))
+, m_slots(slots)
+{
+
+}
+
+malRecord::~malRecord()
+{
+    for (int i = 0, count = m_shape->count(); i < count; i++) {
+        m_slots[i].~malValuePtr();
+    }
+}
+
+malValuePtr malRecord::withSlot(int index, malValuePtr value) const
+{
+    malRecord* record = allocateRecord(m_shapeValue);
+    malValuePtr result(record);
+    std::copy(begin(), end(), record->begin());
+    record->m_slots[index] = value;
+    return result;
+}
+
+malValuePtr
+malRecord::assoc(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        if (m_shape->slotOf(makeHashKey(*it)) < 0) {
+            // Not one of the fields, so it can't stay a record.
+            malHash::Map map(toMap());
+            return mal::hash(addToMap(map, argsBegin, argsEnd));
+        }
+    }
+
+    malRecord* record = allocateRecord(m_shapeValue);
+    malValuePtr result(record);
+    std::copy(begin(), end(), record->begin());
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        record->m_slots[m_shape->slotOf(makeHashKey(*it))] = *(it + 1);
+    }
+    return result;
+}
+
+bool malRecord::contains(malValuePtr key) const
+{
+    return m_shape->slotOf(makeHashKey(key)) >= 0;
+}
+
+malValuePtr
+malRecord::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    malHash::Map map(toMap());
+    bool removed = false;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        removed |= map.erase(makeHashKey(*it)) > 0;
+    }
+    // Without one of its fields, it's only a map.
+    return removed ? mal::hash(map) : malValuePtr(const_cast<malRecord*>(this));
+}
+
+malValuePtr malRecord::get(malValuePtr key) const
+{
+    int slot = m_shape->slotOf(makeHashKey(key));
+    return slot < 0 ? mal::nilValue() : m_slots[slot];
+}
+
+malValuePtr malRecord::keys() const
+{
+    const std::vector<int>& sorted = m_shape->sorted();
+    malValueVec* keys = new malValueVec();
+    keys->reserve(sorted.size());
+    for (auto it = sorted.begin(), end = sorted.end(); it != end; ++it) {
+        keys->push_back(keyOf(m_shape->key(*it)));
+    }
+    return mal::list(keys);
+}
+
+malValuePtr malRecord::values() const
+{
+    const std::vector<int>& sorted = m_shape->sorted();
+    malValueVec* values = new malValueVec();
+    values->reserve(sorted.size());
+    for (auto it = sorted.begin(), end = sorted.end(); it != end; ++it) {
+        values->push_back(m_slots[*it]);
+    }
+    return mal::list(values);
+}
+
+String malRecord::print(bool readably) const
+{
+    String s = "{";
+    const std::vector<int>& sorted = m_shape->sorted();
+    for (auto it = sorted.begin(), end = sorted.end(); it != end; ++it) {
+        if (it != sorted.begin()) {
+            s += " ";
+        }
+        s += m_shape->key(*it) + " " + m_slots[*it]->print(readably);
+    }
+    return s + "}";
+}
+
+bool malRecord::doIsEqualTo(const malValue* rhs) const
+{
+    if (!mightBeEqual(this, rhs, m_shape->count())) {
+        return false;
+    }
+    const malRecord* that = dynamic_cast<const malRecord*>(rhs);
+    if (that && that->m_shape->id() == m_shape->id()) {
+        for (int i = 0, count = m_shape->count(); i < count; i++) {
+            if (!m_slots[i]->isEqualTo(that->m_slots[i].ptr())) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return mapsEqual(toMap(), static_cast<const malHash*>(rhs)->toMap());
+}
+
+size_t malRecord::computeHash() const
+{
+    // The same as a malHash with these entries.
+    const std::vector<int>& sorted = m_shape->sorted();
+    size_t result = sorted.size();
+    for (auto it = sorted.begin(), end = sorted.end(); it != end; ++it) {
+        result = combineHash(result, std::hash<String>()(m_shape->key(*it)));
+        result = combineHash(result, m_slots[*it]->hash());
+    }
+    return result;
+}
+
+malHash::Map malRecord::toMap() const
+{
+    malHash::Map map;
+    for (int i = 0, count = m_shape->count(); i < count; i++) {
+        map[m_shape->key(i)] = m_slots[i];
+    }
+    return map;
+}
+
+malValuePtr malRecord::doWithMeta(malValuePtr meta) const
+{
+    malRecord* record = allocateRecord(m_shapeValue, meta);
+    malValuePtr result(record);
+    std::copy(begin(), end(), record->begin());
+    return result;
+}
+
+void malRecord::freezeChildren()
+{
+    m_shapeValue->freeze();
+    for (int i = 0, count = m_shape->count(); i < count; i++) {
+        m_slots[i]->freeze();
+    }
+}
+
+std::atomic<int> malFieldSite::s_epoch(0);
+
+malFieldSite::malFieldSite(malValuePtr form, malValuePtr target,
+                           malValuePtr key, malValuePtr value)
+: m_form(form)
+, m_target(target)
+, m_key(key)
+, m_value(value)
+, m_hashKey(makeHashKey(key))
+, m_epoch(s_epoch.load())
+, m_cache(0)
+{
+
+}
+
+malFieldSite::malFieldSite(const malFieldSite& that, malValuePtr meta)
+: malValue(meta)
+, m_form(that.m_form)
+, m_target(that.m_target)
+, m_key(that.m_key)
+, m_value(that.m_value)
+, m_hashKey(that.m_hashKey)
+, m_epoch(that.m_epoch)
+, m_cache(that.m_cache.load(std::memory_order_relaxed))
+{
+
+}
+
+int malFieldSite::slotFor(const malShape* shape) const
+{
+    // Shape ids start at 1, so the empty cache never matches.
+    uint64_t cache = m_cache.load(std::memory_order_relaxed);
+    if ((cache >> 32) == shape->id()) {
+        return static_cast<int32_t>(cache);
+    }
+    int slot = shape->slotOf(m_hashKey);
+    m_cache.store((uint64_t(shape->id()) << 32) | uint32_t(slot),
+                  std::memory_order_relaxed);
+    return slot;
+}
+
+malValuePtr malFieldSite::eval(const malEnvPtr& env)
+{
+    if (s_epoch.load(std::memory_order_relaxed) != m_epoch) {
+        return EVAL(m_form, env);
+    }
+
+    malValuePtr target = EVAL(m_target, env);
+    malValuePtr args[2] = { m_key, m_value ? EVAL(m_value, env) : malValuePtr() };
+    if (const malRecord* record = DYNAMIC_CAST(malRecord, target)) {
+        int slot = slotFor(record->shape());
+        if (!m_value) {
+            return slot < 0 ? mal::nilValue() : record->slot(slot);
+        }
+        return slot < 0 ? record->assoc(args, args + 2)
+                        : record->withSlot(slot, args[1]);
+    }
+    if (!m_value) {
+        if (target == mal::nilValue()) {
+            return target;
+        }
+        return VALUE_CAST(malHash, target)->get(m_key);
+    }
+    return VALUE_CAST(malHash, target)->assoc(args, args + 2);
+}
+
+void malFieldSite::freezeChildren()
+{
+    m_form->freeze();
+    m_target->freeze();
+    m_key->freeze();
+    if (m_value) {
+        m_value->freeze();
+    }
+}
+
+// Tags for :type keywords count up from 1, and those for record shapes
+// have the top bit set, so the two never meet.
+static const uint32_t shapeTagBit = 0x80000000;
+
+uint32_t malProtocol::typeTag(const String& keyword)
+{
+    static std::mutex lock;
+    static std::map<String, uint32_t> tags;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = tags.find(keyword);
+    if (it != tags.end()) {
+        return it->second;
+    }
+    uint32_t tag = tags.size() + 1;
+    MAL_CHECK(tag < shapeTagBit, "too many types");
+    tags[keyword] = tag;
+    return tag;
+}
+
+uint32_t malProtocol::typeTag(const malShape* shape)
+{
+    return shapeTagBit | shape->id();
+}
+
+uint32_t malKeyword::typeTag() const
+{
+    uint32_t tag = m_typeTag.load(std::memory_order_relaxed);
+    if (tag == 0) {
+        tag = malProtocol::typeTag(value());
+        m_typeTag.store(tag, std::memory_order_relaxed);
+    }
+    return tag;
+}
+
+// Fills in the tags to look for value's implementations under, in order,
+// and returns how many there are.
+static int typeTagsOf(const malValuePtr& value, uint32_t* tags)
+{
+    struct Builtin {
+        Builtin()
+        : atom(malProtocol::typeTag(":mal/atom"))
+        , boolean(malProtocol::typeTag(":mal/bool"))
+        , fn(malProtocol::typeTag(":mal/fn"))
+        , keyword(malProtocol::typeTag(":mal/keyword"))
+        , list(malProtocol::typeTag(":mal/list"))
+        , map(malProtocol::typeTag(":mal/map"))
+        , nil(malProtocol::typeTag(":mal/nil"))
+        , number(malProtocol::typeTag(":mal/number"))
+        , string(malProtocol::typeTag(":mal/string"))
+        , symbol(malProtocol::typeTag(":mal/symbol"))
+        , vector(malProtocol::typeTag(":mal/vector"))
+        , fallback(malProtocol::typeTag(":mal/default"))
+        , typeKey(mal::keyword(":type")) { }
+
+        const uint32_t atom, boolean, fn, keyword, list, map, nil, number,
+                       string, symbol, vector, fallback;
+        const malValuePtr typeKey;
+    };
+    static const Builtin builtin;
+
+    int count = 0;
+    malValuePtr meta = value->meta();
+    if (meta != mal::nilValue()) {
+        if (const malHash* hash = DYNAMIC_CAST(malHash, meta)) {
+            malValuePtr type = hash->get(builtin.typeKey);
+            if (const malKeyword* keyword = DYNAMIC_CAST(malKeyword, type)) {
+                tags[count++] = keyword->typeTag();
+            }
+        }
+    }
+
+    const std::type_info& type = typeid(*value.ptr());
+    uint32_t tag = 0;
+    if      (type == typeid(malList))    { tag = builtin.list; }
+    else if (type == typeid(malVector))  { tag = builtin.vector; }
+    else if (type == typeid(malHash))    { tag = builtin.map; }
+    else if (type == typeid(malInteger)) { tag = builtin.number; }
+    else if (type == typeid(malString))  { tag = builtin.string; }
+    else if (type == typeid(malKeyword)) { tag = builtin.keyword; }
+    else if (type == typeid(malSymbol))  { tag = builtin.symbol; }
+    else if (type == typeid(malAtom))    { tag = builtin.atom; }
+    else if (type == typeid(malRecord)) {
+        tags[count++] =
+            malProtocol::typeTag(STATIC_CAST(malRecord, value)->shape());
+        tag = builtin.map;
+    }
+    else if (value == mal::nilValue()) {
+        tag = builtin.nil;
+    }
+    else if (type == typeid(malConstant)) {
+        tag = builtin.boolean;
+    }
+    else if (DYNAMIC_CAST(malApplicable, value)) {
+        tag = builtin.fn;
+    }
+    if (tag != 0) {
+        tags[count++] = tag;
+    }
+    tags[count++] = builtin.fallback;
+    return count;
+}
 
-    malValuePtr list(malValuePtr a) {
-        malValueVec* items = new malValueVec(1);
-        items->at(0) = a;
-        return malValuePtr(new malList(items));
+malProtocol::Cache::Cache()
+: m_next(0)
+{
+    for (int i = 0; i < Size; i++) {
+        m_impls[i].store(NULL, std::memory_order_relaxed);
     }
+}
 
-    malValuePtr list(malValuePtr a, malValuePtr b) {
-        malValueVec* items = new malValueVec(2);
-        items->at(0) = a;
-        items->at(1) = b;
-        return malValuePtr(new malList(items));
+const malProtocol::Impls* malProtocol::Cache::find(uint32_t tag) const
+{
+    for (int i = 0; i < Size; i++) {
+        const Impls* impls = m_impls[i].load(std::memory_order_acquire);
+        if (impls && (impls->tag == tag) &&
+            !impls->isStale.load(std::memory_order_relaxed)) {
+            return impls;
+        }
     }
+    return NULL;
+}
 
-    malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c) {
-        malValueVec* items = new malValueVec(3);
-        items->at(0) = a;
-        items->at(1) = b;
-        items->at(2) = c;
-        return malValuePtr(new malList(items));
+void malProtocol::Cache::remember(const Impls* impls)
+{
+    unsigned slot = m_next.fetch_add(1, std::memory_order_relaxed) % Size;
+    m_impls[slot].store(impls, std::memory_order_release);
+}
+
+malProtocol::malProtocol(const String& name,
+                         malValueIter methodsBegin, malValueIter methodsEnd)
+: m_state(new State)
+{
+    m_state->name = name;
+    for (auto it = methodsBegin; it != methodsEnd; ++it) {
+        MAL_CHECK(DYNAMIC_CAST(malKeyword, *it),
+                  "%s is not a keyword", (*it)->print(true).c_str());
+        String method = makeHashKey(*it);
+        MAL_CHECK(methodIndex(method) < 0, "%s is repeated", method.c_str());
+        m_state->methods.push_back(method);
     }
+}
 
-    malValuePtr macro(const malLambda& lambda) {
-        return malValuePtr(new malLambda(lambda, true));
-    };
+malProtocol::malProtocol(const malProtocol& that, malValuePtr meta)
+: malValue(meta)
+, m_state(that.m_state)
+{
 
-    malValuePtr nilValue() {
-        static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
-    };
+}
 
-    malValuePtr string(const String& token) {
-        return malValuePtr(new malString(token));
+int malProtocol::methodIndex(const String& hashKey) const
+{
+    const StringVec& methods = m_state->methods;
+    auto it = std::find(methods.begin(), methods.end(), hashKey);
+    return it == methods.end() ? -1 : it - methods.begin();
+}
+
+void malProtocol::extend(uint32_t tag, const malHash* fns)
+{
+    malValueVec impls(m_state->methods.size());
+    malHash::Map map = fns->toMap();
+    for (auto it = map.begin(), end = map.end(); it != end; ++it) {
+        int index = methodIndex(it->first);
+        MAL_CHECK(index >= 0, "%s is not a method of %s",
+                  it->first.c_str(), m_state->name.c_str());
+        impls[index] = it->second;
     }
 
-    malValuePtr symbol(const String& token) {
-        return malValuePtr(new malSymbol(token));
-    };
+    std::lock_guard<std::mutex> guard(m_state->lock);
+    m_state->extended[tag] = impls;
 
-    malValuePtr trueValue() {
-        static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
-    };
+    // Whatever any tag found before might not be what it finds now.
+    auto& resolved = m_state->resolved;
+    for (auto it = resolved.begin(), end = resolved.end(); it != end; ++it) {
+        it->second->isStale.store(true, std::memory_order_relaxed);
+    }
+    resolved.clear();
+}
 
-    malValuePtr vector(malValueVec* items) {
-        return malValuePtr(new malVector(items));
-    };
+const malProtocol::Impls* malProtocol::resolve(uint32_t tag) const
+{
+    std::lock_guard<std::mutex> guard(m_state->lock);
+    auto it = m_state->resolved.find(tag);
+    if (it != m_state->resolved.end()) {
+        return it->second;
+    }
+    auto fns = m_state->extended.find(tag);
+    Impls* impls = new Impls(tag, fns == m_state->extended.end()
+                                      ? malValueVec() : fns->second);
+    m_state->all.emplace_back(impls);
+    m_state->resolved[tag] = impls;
+    return impls;
+}
 
-    malValuePtr vector(malValueIter begin, malValueIter end) {
-        return malValuePtr(new malVector(begin, end));
-    };
-};
+const malProtocol::Impls*
+malProtocol::implsFor(const malValuePtr& value, Cache& cache) const
+{
+    uint32_t tags[4];
+    int count = typeTagsOf(value, tags);
+    for (int i = 0; i < count; i++) {
+        const Impls* impls = cache.find(tags[i]);
+        if (!impls) {
+            impls = resolve(tags[i]);
+            cache.remember(impls);
+        }
+        if (!impls->fns.empty()) {
+            return impls;
+        }
+    }
+    return NULL;
+}
 
-malValuePtr malBuiltIn::apply(malValueIter argsBegin,
+malValuePtr malProtocol::call(int method, Cache& cache,
+                              malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
-    return m_handler(m_name, argsBegin, argsEnd);
+    const String& name = m_state->methods[method];
+    MAL_CHECK(argsBegin != argsEnd, "%s/%s needs an argument",
+              m_state->name.c_str(), name.c_str() + 1);
+    const Impls* impls = implsFor(*argsBegin, cache);
+    MAL_CHECK(impls && impls->fns[method], "no %s/%s for %s",
+              m_state->name.c_str(), name.c_str() + 1,
+              (*argsBegin)->print(true).c_str());
+    return APPLY(impls->fns[method], argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+malProtocolFn::malProtocolFn(malValuePtr protocol, int method)
+: m_protocolValue(protocol)
+, m_protocol(STATIC_CAST(malProtocol, protocol))
+, m_method(method)
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
-    }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
-    }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+
 }
 
-static malHash::Map addToMap(malHash::Map& map,
-    malValueIter argsBegin, malValueIter argsEnd)
+malProtocolFn::malProtocolFn(const malProtocolFn& that, malValuePtr meta)
+: malApplicable(meta)
+, m_protocolValue(that.m_protocolValue)
+, m_protocol(that.m_protocol)
+, m_method(that.m_method)
 {
-    // This is intended to be called with pre-evaluated arguments.
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
-    }
 
-    return map;
 }
 
-static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr malProtocolFn::apply(malValueIter argsBegin,
+                                 malValueIter argsEnd) const
 {
-    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
-            "hash-map requires an even-sized list");
+    return m_protocol->call(m_method, m_cache, argsBegin, argsEnd);
+}
 
-    malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
+String malProtocolFn::print(bool readably) const
+{
+    return STRF("#protocol-function(%s/%s)", m_protocol->name().c_str(),
+                m_protocol->method(m_method).c_str() + 1);
 }
 
-malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
-: m_map(createMap(argsBegin, argsEnd))
-, m_isEvaluated(isEvaluated)
+void malProtocolFn::freezeChildren()
+{
+    m_protocolValue->freeze();
+}
+
+malDispatchSite::malDispatchSite(malValuePtr form, malValuePtr fn)
+: m_form(form)
+, m_fn(fn)
+, m_method(STATIC_CAST(malProtocolFn, fn))
 {
 
 }
 
-malHash::malHash(const malHash::Map& map)
-: m_map(map)
-, m_isEvaluated(true)
+malDispatchSite::malDispatchSite(const malDispatchSite& that,
+                                 malValuePtr meta)
+: malValue(meta)
+, m_form(that.m_form)
+, m_fn(that.m_fn)
+, m_method(that.m_method)
 {
 
 }
 
-malValuePtr
-malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
+malValuePtr malDispatchSite::eval(const malEnvPtr& env)
 {
-    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
-            "assoc requires an even-sized list");
+    const malList* form = STATIC_CAST(malList, m_form);
+    if (EVAL(form->item(0), env) != m_fn) {
+        return EVAL(m_form, env);
+    }
 
-    malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    ArgStack::Frame args(form->count() - 1);
+    for (int i = 1; i < form->count(); i++) {
+        args[i - 1] = EVAL(form->item(i), env);
+    }
+    return m_method->protocol()->call(m_method->method(), m_cache,
+                                      args.begin(), args.end());
 }
 
-bool malHash::contains(malValuePtr key) const
+void malDispatchSite::freezeChildren()
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    m_form->freeze();
+    m_fn->freeze();
 }
 
-malValuePtr
-malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
+malTransient::malTransient(const malVector* vector)
+: m_isMap(false)
+, m_isPersistent(false)
+, m_owner(std::this_thread::get_id())
+, m_block(NULL)
+, m_items(NULL)
+, m_count(0)
+, m_capacity(0)
 {
-    malHash::Map map(m_map);
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
-    }
-    return mal::hash(map);
+    reserve(std::max(vector->count(), 8));
+    std::uninitialized_copy(vector->begin(), vector->end(), m_items);
+    m_count = vector->count();
 }
 
-malValuePtr malHash::eval(malEnvPtr env)
+malTransient::malTransient(const malHash* hash)
+: m_isMap(true)
+, m_isPersistent(false)
+, m_owner(std::this_thread::get_id())
+, m_block(NULL)
+, m_items(NULL)
+, m_count(0)
+, m_capacity(0)
+, m_map(hash->toMap())
 {
-    if (m_isEvaluated) {
-        return malValuePtr(this);
-    }
 
-    malHash::Map map;
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
+}
+
+malTransient::~malTransient()
+{
+    for (int i = 0; i < m_count; i++) {
+        m_items[i].~malValuePtr();
     }
-    return mal::hash(map);
+    ::operator delete(m_block);
 }
 
-malValuePtr malHash::get(malValuePtr key) const
+void malTransient::check(const char* op, bool isMap) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    MAL_CHECK(!m_isPersistent, "%s on a transient after persistent!", op);
+    MAL_CHECK(m_owner == std::this_thread::get_id(),
+              "%s on a transient from another thread", op);
+    MAL_CHECK(m_isMap == isMap, "%s needs a transient %s", op,
+              isMap ? "map" : "vector");
 }
 
-malValuePtr malHash::keys() const
+void malTransient::reserve(int capacity)
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
+    void* block = ::operator new(sizeof(malVector)
+                                 + capacity * sizeof(malValuePtr));
+    malValuePtr* items = reinterpret_cast<malValuePtr*>(
+        static_cast<char*>(block) + sizeof(malVector));
+    for (int i = 0; i < m_count; i++) {
+        new (items + i) malValuePtr(std::move(m_items[i]));
+        m_items[i].~malValuePtr();
     }
-    return mal::list(keys);
+    ::operator delete(m_block);
+    m_block = block;
+    m_items = items;
+    m_capacity = capacity;
 }
 
-malValuePtr malHash::values() const
+void malTransient::conj(malValueIter argsBegin, malValueIter argsEnd)
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
+    check("conj!", false);
+    int count = m_count + std::distance(argsBegin, argsEnd);
+    if (count > m_capacity) {
+        reserve(std::max(count, 2 * m_capacity));
     }
-    return mal::list(keys);
+    std::uninitialized_copy(argsBegin, argsEnd, m_items + m_count);
+    m_count = count;
 }
 
-String malHash::print(bool readably) const
+void malTransient::assoc(malValueIter argsBegin, malValueIter argsEnd)
 {
-    String s = "{";
+    check("assoc!", true);
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc! requires an even-sized list");
+    addToMap(m_map, argsBegin, argsEnd);
+}
 
-    auto it = m_map.begin(), end = m_map.end();
-    if (it != end) {
-        s += it->first + " " + it->second->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+void malTransient::dissoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    check("dissoc!", true);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_map.erase(makeHashKey(*it));
     }
-
-    return s + "}";
 }
 
-bool malHash::doIsEqualTo(const malValue* rhs) const
+malValuePtr malTransient::persistent()
 {
-    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
-        return false;
+    check("persistent!", m_isMap);
+    m_isPersistent = true;
+    if (m_isMap) {
+        return mal::hash(std::move(m_map));
     }
+    // The slack past m_count was never constructed, and the vector
+    // doesn't know about it, so it's freed along with the block.
+    malValuePtr result(new (m_block) malVector(m_items, m_count, NULL));
+    m_block = NULL;
+    m_items = NULL;
+    m_count = 0;
+    return result;
+}
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
+malValuePtr malTransient::doWithMeta(malValuePtr meta) const
+{
+    MAL_FAIL("transients can't have metadata");
+}
 
-        if (it0->first != it1->first) {
-            return false;
-        }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
-            return false;
-        }
+void malTransient::freezeChildren()
+{
+    for (int i = 0; i < m_count; i++) {
+        m_items[i]->freeze();
+    }
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        it->second->freeze();
     }
-    return true;
 }
 
 malLambda::malLambda(const StringVec& bindings,
@@ -276,6 +1710,10 @@ malLambda::malLambda(const StringVec& bindings,
 , m_body(body)
 , m_env(env)
 , m_isMacro(false)
+#ifdef MAL_JIT
+, m_jitCalls(0)
+, m_jitCode(NULL)
+#endif
 {
 
 }
@@ -286,6 +1724,10 @@ malLambda::malLambda(const malLambda& that, malValuePtr meta)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
+#ifdef MAL_JIT
+, m_jitCalls(0)
+, m_jitCode(NULL)
+#endif
 {
 
 }
@@ -296,14 +1738,34 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
+#ifdef MAL_JIT
+, m_jitCalls(0)
+, m_jitCode(NULL)
+#endif
 {
 
 }
 
+#ifdef MAL_JIT
+malLambda::~malLambda()
+{
+    jitFree(m_jitCode);
+}
+#endif
+
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
+#ifdef MAL_JIT
+    malValuePtr ast = m_body, result;
+    malEnvPtr env = makeEnv(argsBegin, argsEnd);
+    if (jitEnter(this, ast, env, result)) {
+        return result;
+    }
+    return EVAL(ast, env);
+#else
     return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+#endif
 }
 
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
@@ -311,25 +1773,107 @@ malValuePtr malLambda::doWithMeta(malValuePtr meta) const
     return new malLambda(*this, meta);
 }
 
+void malLambda::freezeChildren()
+{
+    m_body->freeze();
+    m_env->freeze();
+}
+
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
 }
 
+void malLambda::makeTailEnv(malEnvPtr& env,
+                            malValueIter argsBegin, malValueIter argsEnd) const
+{
+    // A tail call from a let* or catch* in the body is made in a frame
+    // inside the lambda's own, so the frames it's inside are tried too.
+    for (malEnv* frame = env.ptr(); frame; frame = frame->soleOuter()) {
+        if (frame->rebind(m_env, m_bindings, argsBegin, argsEnd)) {
+            env = frame;
+            return;
+        }
+    }
+    env = makeEnv(argsBegin, argsEnd);
+}
+
+malCompiledFn::malCompiledFn(Code code, malEnvPtr env,
+                             const malValueVec& captures)
+: m_code(code)
+, m_env(env)
+, m_captures(captures)
+{
+
+}
+
+malCompiledFn::malCompiledFn(const malCompiledFn& that, malValuePtr meta)
+: malApplicable(meta)
+, m_code(that.m_code)
+, m_env(that.m_env)
+, m_captures(that.m_captures)
+{
+
+}
+
+// The tail call this thread's compiled code has most recently handed back.
+static thread_local malValuePtr s_tailCallee;
+static thread_local malValueVec s_tailCallArgs;
+
+malValuePtr malCompiledFn::apply(malValueIter argsBegin,
+                                 malValueIter argsEnd) const
+{
+    malValuePtr result = m_code(this, argsBegin, argsEnd);
+    malValueVec args;
+    while (!result) {
+        malValuePtr callee = std::move(s_tailCallee);
+        args.swap(s_tailCallArgs);
+        s_tailCallArgs.clear();
+        const malCompiledFn* fn = STATIC_CAST(malCompiledFn, callee);
+        result = fn->m_code(fn, beginOf(args), endOf(args));
+    }
+    return result;
+}
+
+malValuePtr malCompiledFn::tailCall(const malValuePtr& op,
+                                    malValueIter argsBegin,
+                                    malValueIter argsEnd)
+{
+    if (!DYNAMIC_CAST(malCompiledFn, op)) {
+        return APPLY(op, argsBegin, argsEnd);
+    }
+    s_tailCallee = op;
+    s_tailCallArgs.assign(argsBegin, argsEnd);
+    return NULL;
+}
+
+void malCompiledFn::freezeChildren()
+{
+    for (auto& value : m_captures) {
+        value->freeze();
+    }
+    m_env->freeze();
+}
+
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
     int oldItemCount = std::distance(begin(), end());
     int newItemCount = std::distance(argsBegin, argsEnd);
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::reverse_copy(argsBegin, argsEnd, items->begin());
-    std::copy(begin(), end(), items->begin() + newItemCount);
+    malList* list = allocateSequence<malList>(oldItemCount + newItemCount);
+    std::reverse_copy(argsBegin, argsEnd, list->begin());
+    std::copy(begin(), end(), list->begin() + newItemCount);
 
-    return mal::list(items);
+    return malValuePtr(list);
 }
 
-malValuePtr malList::eval(malEnvPtr env)
+malValuePtr malList::doWithMeta(malValuePtr meta) const
+{
+    return copySequence<malList>(begin(), end(), meta);
+}
+
+malValuePtr malList::eval(const malEnvPtr& env)
 {
     // Note, this isn't actually called since the TCO updates, but
     // is required for the earlier steps, so don't get rid of it.
@@ -338,9 +1882,9 @@ malValuePtr malList::eval(malEnvPtr env)
     }
 
     std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
+    malValueIter it = beginOf(*items);
     malValuePtr op = *it;
-    return APPLY(op, ++it, items->end());
+    return APPLY(op, ++it, endOf(*items));
 }
 
 String malList::print(bool readably) const
@@ -348,7 +1892,7 @@ String malList::print(bool readably) const
     return '(' + malSequence::print(readably) + ')';
 }
 
-malValuePtr malValue::eval(malEnvPtr env)
+malValuePtr malValue::eval(const malEnvPtr& env)
 {
     // Default case of eval is just to return the object itself.
     return malValuePtr(this);
@@ -356,10 +1900,19 @@ malValuePtr malValue::eval(malEnvPtr env)
 
 bool malValue::isEqualTo(const malValue* rhs) const
 {
-    // Special-case. Vectors and Lists can be compared.
+    // Anything is equal to itself, which also saves walking whatever two
+    // collections share.
+    if (this == rhs) {
+        return true;
+    }
+
+    // Special-case. Vectors and Lists can be compared, and so can records
+    // and maps.
     bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
         (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+         dynamic_cast<const malSequence*>(rhs)) ||
+        (dynamic_cast<const malHash*>(this) &&
+         dynamic_cast<const malHash*>(rhs));
 
     return matchingTypes && doIsEqualTo(rhs);
 }
@@ -370,50 +1923,63 @@ bool malValue::isTrue() const
         && (this != mal::nilValue().ptr());
 }
 
-malValuePtr malValue::meta() const
-{
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
-}
-
-malValuePtr malValue::withMeta(malValuePtr meta) const
-{
-    return doWithMeta(meta);
-}
+// The values whose children are still to be frozen, while this thread is
+// freezing something. freezeChildren's calls to freeze queue their values
+// here rather than recursing, so freezing a deeply nested structure doesn't
+// grow the C++ stack with its depth, as with RefCounted::dispose.
+static thread_local std::vector<malValue*>* s_freezing = NULL;
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+void malValue::freeze()
 {
+    if (isImmortal()) {
+        return; // also stops us going round cycles
+    }
+    makeImmortal();
+    if (s_freezing) {
+        s_freezing->push_back(this);
+        return;
+    }
 
+    std::vector<malValue*> pending(1, this);
+    s_freezing = &pending;
+    while (!pending.empty()) {
+        malValue* value = pending.back();
+        pending.pop_back();
+        if (value->m_meta) {
+            value->m_meta->freeze();
+        }
+        value->freezeChildren();
+    }
+    s_freezing = NULL;
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+malValuePtr malValue::meta() const
 {
-
+    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
 }
 
-malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+malValuePtr malValue::withMeta(malValuePtr meta) const
 {
-
+    return doWithMeta(meta);
 }
 
 malSequence::~malSequence()
 {
-    delete m_items;
+    for (int i = 0; i < m_count; i++) {
+        m_items[i].~malValuePtr();
+    }
 }
 
 bool malSequence::doIsEqualTo(const malValue* rhs) const
 {
     const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
-    if (count() != rhsSeq->count()) {
+    if ((count() != rhsSeq->count()) || !mightBeEqual(this, rhs, count())) {
         return false;
     }
 
-    for (malValueIter it0 = m_items->begin(),
+    for (malValueIter it0 = begin(),
                       it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+                      stop = end(); it0 != stop; ++it0, ++it1) {
 
         if (! (*it0)->isEqualTo((*it1).ptr())) {
             return false;
@@ -422,11 +1988,18 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
+void malSequence::freezeChildren()
+{
+    for (auto it = begin(), stop = end(); it != stop; ++it) {
+        (*it)->freeze();
+    }
+}
+
 malValueVec* malSequence::evalItems(malEnvPtr env) const
 {
     malValueVec* items = new malValueVec;;
     items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+    for (auto it = begin(), stop = end(); it != stop; ++it) {
         items->push_back(EVAL(*it, env));
     }
     return items;
@@ -440,19 +2013,38 @@ malValuePtr malSequence::first() const
 String malSequence::print(bool readably) const
 {
     String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
-    if (it != end) {
+    auto stop = end();
+    auto it = begin();
+    if (it != stop) {
         str += (*it)->print(readably);
         ++it;
     }
-    for ( ; it != end; ++it) {
+    for ( ; it != stop; ++it) {
         str += " ";
         str += (*it)->print(readably);
     }
     return str;
 }
 
+size_t malSequence::hash() const
+{
+    size_t hash = m_hash.load(std::memory_order_relaxed);
+    if (hash == 0) {
+        hash = hashItems(begin(), end());
+        m_hash.store(hash, std::memory_order_relaxed);
+    }
+    return hash;
+}
+
+size_t malSequence::hashItems(malValueIter begin, malValueIter end)
+{
+    size_t result = end - begin;
+    for (auto it = begin; it != end; ++it) {
+        result = combineHash(result, (*it)->hash());
+    }
+    return result;
+}
+
 malValuePtr malSequence::rest() const
 {
     malValueIter start = (count() > 0) ? begin() + 1 : end();
@@ -469,7 +2061,7 @@ String malString::print(bool readably) const
     return readably ? escapedValue() : value();
 }
 
-malValuePtr malSymbol::eval(malEnvPtr env)
+malValuePtr malSymbol::eval(const malEnvPtr& env)
 {
     return env->get(value());
 }
@@ -480,16 +2072,48 @@ malValuePtr malVector::conj(malValueIter argsBegin,
     int oldItemCount = std::distance(begin(), end());
     int newItemCount = std::distance(argsBegin, argsEnd);
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+    malVector* vec = allocateSequence<malVector>(oldItemCount + newItemCount);
+    std::copy(begin(), end(), vec->begin());
+    std::copy(argsBegin, argsEnd, vec->begin() + oldItemCount);
+
+    return malValuePtr(vec);
+}
+
+malValuePtr malVector::doWithMeta(malValuePtr meta) const
+{
+    return copySequence<malVector>(begin(), end(), meta);
+}
 
-    return mal::vector(items);
+malValuePtr malVector::eval(const malEnvPtr& env)
+{
+    if (isLiteral()) {
+        return malValuePtr(this);
+    }
+    malValuePtr result(allocateSequence<malVector>(count()));
+    malValueIter items = STATIC_CAST(malVector, result)->begin();
+    for (int i = 0; i < count(); i++) {
+        items[i] = EVAL(item(i), env);
+    }
+    return result;
 }
 
-malValuePtr malVector::eval(malEnvPtr env)
+bool malVector::isLiteral() const
 {
-    return mal::vector(evalItems(env));
+    if (m_meta) {
+        return false; // evaluating it drops the metadata
+    }
+    Literal literal = m_literal.load(std::memory_order_relaxed);
+    if (literal == Unknown) {
+        literal = Yes;
+        for (auto it = begin(), stop = end(); it != stop; ++it) {
+            if (!(*it)->isLiteral()) {
+                literal = No;
+                break;
+            }
+        }
+        m_literal.store(literal, std::memory_order_relaxed);
+    }
+    return literal == Yes;
 }
 
 String malVector::print(bool readably) const
@@ -3,8 +3,16 @@
 
 #include "MAL.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <exception>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 class malEmptyInputException : public std::exception { };
 
@@ -28,18 +36,29 @@ public:
 
     bool isEqualTo(const malValue* rhs) const;
 
-    virtual malValuePtr eval(malEnvPtr env);
+    // A hash which agrees with isEqualTo: equal values hash the same.
+    // Values which are only ever equal to themselves hash their address.
+    virtual size_t hash() const { return std::hash<const void*>()(this); }
+
+    virtual malValuePtr eval(const malEnvPtr& env);
+
+    // Whether evaluating this gives back this same value.
+    virtual bool isLiteral() const { return true; }
 
     virtual String print(bool readably) const = 0;
 
+    // Makes this and everything reachable from it immortal.
+    void freeze();
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
+    virtual void freezeChildren() { }
 
     malValuePtr m_meta;
 };
 
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
+T* value_cast(const malValuePtr& obj, const char* typeName) {
     T* dest = dynamic_cast<T*>(obj.ptr());
     MAL_CHECK(dest != NULL, "%s is not a %s",
               obj->print(true).c_str(), typeName);
@@ -57,7 +76,9 @@ T* value_cast(malValuePtr obj, const char* typeName) {
 
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
+    malConstant(String name) : m_name(name) {
+        makeImmortal(); // so handing out nil and friends doesn't count
+    }
     malConstant(const malConstant& that, malValuePtr meta)
         : malValue(meta), m_name(that.m_name) { }
 
@@ -89,6 +110,8 @@ public:
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
 
+    virtual size_t hash() const { return std::hash<int64_t>()(m_value); }
+
     WITH_META(malInteger);
 
 private:
@@ -104,7 +127,9 @@ public:
 
     virtual String print(bool readably) const { return m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
+
+    virtual size_t hash() const { return std::hash<String>()(m_value); }
 
 private:
     const String m_value;
@@ -131,15 +156,23 @@ public:
 class malKeyword : public malStringBase {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(token), m_typeTag(0) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta)
+        , m_typeTag(that.m_typeTag.load(std::memory_order_relaxed)) { }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malKeyword*>(rhs)->value();
     }
 
+    // The tag protocols dispatch on for values with this :type, looked up
+    // once and kept.
+    uint32_t typeTag() const;
+
     WITH_META(malKeyword);
+
+private:
+    mutable std::atomic<uint32_t> m_typeTag;
 };
 
 class malSymbol : public malStringBase {
@@ -149,7 +182,8 @@ public:
     malSymbol(const malSymbol& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const { return false; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malSymbol*>(rhs)->value();
@@ -158,67 +192,87 @@ public:
     WITH_META(malSymbol);
 };
 
+// Lists and vectors are made only by the mal:: functions, which allocate
+// their items in the same block as the object, straight after it. None of
+// them changes size once it's made, so nothing needs growable storage.
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
-    malSequence(const malSequence& that, malValuePtr meta);
     virtual ~malSequence();
 
+    // The block was allocated with ::operator new, and is bigger than the
+    // object, so it has to be freed without a size.
+    static void operator delete(void* block) { ::operator delete(block); }
+
     virtual String print(bool readably) const;
 
     malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    const malValuePtr& item(int index) const { return m_items[index]; }
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    malValueIter begin() const { return m_items; }
+    malValueIter end()   const { return m_items + m_count; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    // Worked out the first time it's needed, and kept.
+    virtual size_t hash() const;
+
+    // The hash of a list or vector of these items.
+    static size_t hashItems(malValueIter begin, malValueIter end);
+
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
 
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+protected:
+    // items points at count values, constructed straight after the object.
+    malSequence(malValuePtr* items, int count, malValuePtr meta)
+        : malValue(meta), m_items(items), m_count(count), m_hash(0) { }
+
+    virtual void freezeChildren();
+
 private:
-    malValueVec* const m_items;
+    malValuePtr* const m_items;
+    const int          m_count;
+
+    mutable std::atomic<size_t> m_hash; // 0 until it's worked out
 };
 
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
-    malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
-    malList(const malList& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+    malList(malValuePtr* items, int count, malValuePtr meta)
+        : malSequence(items, count, meta) { }
 
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
     virtual String print(bool readably) const;
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const { return isEmpty(); }
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
-
-    WITH_META(malList);
 };
 
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
-    malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
-    malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+    malVector(malValuePtr* items, int count, malValuePtr meta)
+        : malSequence(items, count, meta), m_literal(Unknown) { }
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const;
     virtual String print(bool readably) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
-    WITH_META(malVector);
+private:
+    // Worked out on the first call to isLiteral, so that a vector literal
+    // in a function body is only rebuilt if it needs to be.
+    enum Literal : char { Unknown, Yes, No };
+    mutable std::atomic<Literal> m_literal;
 };
 
 class malApplicable : public malValue {
@@ -236,26 +290,147 @@ public:
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
     malHash(const malHash::Map& map);
+    malHash(malHash::Map&& map);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated)
+    , m_literal(Unknown), m_hash(that.m_hash.load()) { }
 
-    malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    bool contains(malValuePtr key) const;
-    malValuePtr eval(malEnvPtr env);
-    malValuePtr get(malValuePtr key) const;
-    malValuePtr keys() const;
-    malValuePtr values() const;
+    virtual malValuePtr assoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+    virtual malValuePtr dissoc(malValueIter argsBegin,
+                               malValueIter argsEnd) const;
+    virtual bool contains(malValuePtr key) const;
+    malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const;
+    virtual malValuePtr get(malValuePtr key) const;
+    virtual malValuePtr keys() const;
+    virtual malValuePtr values() const;
 
     virtual String print(bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    // Worked out the first time it's needed, and kept.
+    virtual size_t hash() const;
+
+    // The entries, keyed as makeHashKey keys them.
+    virtual Map toMap() const { return m_map; }
+
+    // The key which makeHashKey made, as a value again.
+    static malValuePtr keyOf(const String& hashKey);
+
     WITH_META(malHash);
 
+protected:
+    // An empty map, for malRecord, which keeps its entries itself.
+    malHash(malValuePtr meta)
+    : malValue(meta), m_isEvaluated(true), m_literal(Yes), m_hash(0) { }
+
+    virtual size_t computeHash() const;
+    virtual void freezeChildren();
+
 private:
     const Map m_map;
     const bool m_isEvaluated;
+
+    // As for malVector, but over the values of a hash literal.
+    enum Literal : char { Unknown, Yes, No };
+    mutable std::atomic<Literal> m_literal;
+
+    mutable std::atomic<size_t> m_hash; // 0 until it's worked out
+};
+
+// The fields of a record type: an ordered set of keywords, each of which
+// has its own slot in the records made with this shape. Shapes are only
+// ever equal to themselves, so records which share one share a layout.
+class malShape : public malValue {
+public:
+    malShape(malValueIter keysBegin, malValueIter keysEnd);
+    malShape(const malShape& that, malValuePtr meta);
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    int count() const { return m_keys.size(); }
+    const String& key(int slot) const { return m_keys[slot]; }
+
+    // The slot for a key as makeHashKey makes it, or -1 if it has none.
+    int slotOf(const String& hashKey) const {
+        auto it = m_slots.find(hashKey);
+        return it == m_slots.end() ? -1 : it->second;
+    }
+
+    // The slots in the order of their keys, which is the order a malHash
+    // with the same keys would keep them in.
+    const std::vector<int>& sorted() const { return m_sorted; }
+
+    // Never 0, and never used by another shape, so caches can key on it.
+    uint32_t id() const { return m_id; }
+
+    WITH_META(malShape);
+
+private:
+    StringVec                m_keys;
+    std::map<String, int>    m_slots;
+    std::vector<int>         m_sorted;
+    const uint32_t           m_id;
+
+    static std::atomic<uint32_t> s_nextId;
+};
+
+// A map with the keys of its shape. The values are kept in slots straight
+// after the object, in the same block, as malSequence keeps its items.
+// It's still a malHash, so anything which takes a map takes a record;
+// assoc'ing a key which isn't one of its fields, or dissoc'ing any, gives
+// a plain map back.
+class malRecord : public malHash {
+public:
+    virtual ~malRecord();
+
+    // See malSequence.
+    static void operator delete(void* block) { ::operator delete(block); }
+
+    // slots points at the shape's count of values, constructed straight
+    // after the object.
+    malRecord(malValuePtr shape, malValuePtr* slots, malValuePtr meta);
+
+    const malShape* shape() const { return m_shape; }
+    const malValuePtr& slot(int index) const { return m_slots[index]; }
+
+    malValueIter begin() const { return m_slots; }
+    malValueIter end()   const { return m_slots + m_shape->count(); }
+
+    // A copy of this record with one slot set to value.
+    malValuePtr withSlot(int index, malValuePtr value) const;
+
+    virtual malValuePtr assoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+    virtual malValuePtr dissoc(malValueIter argsBegin,
+                               malValueIter argsEnd) const;
+    virtual bool contains(malValuePtr key) const;
+    virtual malValuePtr get(malValuePtr key) const;
+    virtual malValuePtr keys() const;
+    virtual malValuePtr values() const;
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const;
+
+    virtual Map toMap() const;
+
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+
+protected:
+    virtual size_t computeHash() const;
+    virtual void freezeChildren();
+
+private:
+    const malValuePtr     m_shapeValue;
+    const malShape* const m_shape;
+    malValuePtr* const    m_slots;
 };
 
 class malBuiltIn : public malApplicable {
@@ -264,15 +439,25 @@ public:
                                     malValueIter argsBegin,
                                     malValueIter argsEnd);
 
-    malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    // The integer builtins which EVAL applies directly to two arguments.
+    enum InlineOp { NotInline, Add, Sub, Mul, Div, Mod, LessEqual, Equal };
+
+    malBuiltIn(const String& name, ApplyFunc* handler);
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler)
+    , m_inlineOp(that.m_inlineOp) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
+    // Computes the result straight from the integers if both arguments
+    // are, and otherwise applies the builtin as usual.
+    malValuePtr applyInline(const malValuePtr& lhs,
+                            const malValuePtr& rhs) const;
+
+    InlineOp inlineOp() const { return m_inlineOp; }
+
     virtual String print(bool readably) const {
         return STRF("#builtin-function(%s)", m_name.c_str());
     }
@@ -288,20 +473,37 @@ public:
 private:
     const String m_name;
     ApplyFunc* m_handler;
+    const InlineOp m_inlineOp;
 };
 
+#ifdef MAL_JIT
+struct JitCode;
+#endif
+
 class malLambda : public malApplicable {
 public:
     malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
+#ifdef MAL_JIT
+    ~malLambda();
+
+    // Counts a call, returning the body's native code once it's hot.
+    JitCode* jit() const;
+#endif
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
-    malValuePtr getBody() const { return m_body; }
+    const malValuePtr& getBody() const { return m_body; }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
+    // Points env at the frame for a tail call to this lambda, reusing the
+    // frame it points at already, or one that frame was made inside, if no
+    // closure has kept hold of it.
+    void makeTailEnv(malEnvPtr& env,
+                     malValueIter argsBegin, malValueIter argsEnd) const;
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // do we need to do a deep inspection?
     }
@@ -314,45 +516,623 @@ public:
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+protected:
+    virtual void freezeChildren();
+
 private:
     const StringVec   m_bindings;
     const malValuePtr m_body;
     const malEnvPtr   m_env;
     const bool        m_isMacro;
+#ifdef MAL_JIT
+    mutable std::atomic<int>      m_jitCalls;
+    mutable std::atomic<JitCode*> m_jitCode;
+#endif
+};
+
+// A function compiled to C++ by malc. The code gets the function itself,
+// for its captured values and the global environment.
+class malCompiledFn : public malApplicable {
+public:
+    typedef malValuePtr (*Code)(const malCompiledFn* self,
+                                malValueIter argsBegin, malValueIter argsEnd);
+
+    malCompiledFn(Code code, malEnvPtr env, const malValueVec& captures);
+    malCompiledFn(const malCompiledFn& that, malValuePtr meta);
+
+    // Runs the code, and then any tail calls it hands back, so that
+    // compiled functions which tail call each other run in constant stack.
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    // A tail call from compiled code, which returns the result. A call to
+    // another compiled function is only noted, and NULL returned, for the
+    // apply which is running the caller to make once the caller's frame
+    // has gone. Anything else is applied straight away.
+    static malValuePtr tailCall(const malValuePtr& op,
+                                malValueIter argsBegin, malValueIter argsEnd);
+
+    const malEnvPtr& env() const { return m_env; }
+    const malValuePtr& capture(int index) const { return m_captures[index]; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#user-function(%p)", this);
+    }
+
+    WITH_META(malCompiledFn);
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    const Code        m_code;
+    const malEnvPtr   m_env;
+    const malValueVec m_captures;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
-    malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+    malAtom(malValuePtr value);
+    malAtom(const malAtom& that, malValuePtr meta);
+    ~malAtom();
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return this->m_value->isEqualTo(rhs);
+        return this == rhs;
     }
 
     virtual String print(bool readably) const {
-        return "(atom " + m_value->print(readably) + ")";
+        return "(atom " + deref()->print(readably) + ")";
     };
 
-    malValuePtr deref() const { return m_value; }
+    malValuePtr deref() const;
+    malValuePtr reset(malValuePtr value);
+
+    // Replaces the value only if it is still the same object as expected.
+    bool compareAndSet(malValuePtr expected, malValuePtr value);
 
-    malValuePtr reset(malValuePtr value) { return m_value = value; }
+    // Applies op to the current value and args, retrying until no other
+    // thread has changed the atom in the meantime. Returns the value that
+    // was replaced, and sets newValue to the one that replaced it.
+    malValuePtr swap(malValuePtr op, malValueIter argsBegin,
+                     malValueIter argsEnd, malValuePtr& newValue);
+
+    void addWatch(malValuePtr key, malValuePtr fn);
+    void removeWatch(malValuePtr key);
+    void notifyWatches(malValuePtr oldValue, malValuePtr newValue);
+
+    int64_t swapCount() const  { return m_swaps.load(); }
+    int64_t retryCount() const { return m_retries.load(); }
 
     WITH_META(malAtom);
 
+protected:
+    virtual void freezeChildren();
+
+private:
+    void retire(malValue* value);
+
+    // The atom holds one reference to m_value. Readers bump m_readers
+    // around the load and acquire, and writers wait for it to drain
+    // before dropping the reference to a value they have replaced.
+    std::atomic<malValue*>       m_value;
+    mutable std::atomic<int>     m_readers;
+    std::atomic<int64_t>         m_swaps;
+    std::atomic<int64_t>         m_retries;
+
+    std::mutex                   m_watchLock;
+    malValueVec                  m_watches; // key, fn, key, fn...
+};
+
+// A function whose results are kept, keyed on its arguments, made by
+// memoize and memoize-lru. Copies made with metadata share the table. It's
+// locked while it's searched, but not while the function runs, so calls
+// can recurse, and run on several threads at once.
+class malMemo : public malApplicable {
+public:
+    malMemo(malValuePtr fn, int64_t capacity);
+    malMemo(const malMemo& that, malValuePtr meta);
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#memoized-function(%p)", this);
+    }
+
+    int64_t hitCount() const;
+    int64_t missCount() const;
+    int64_t evictionCount() const;
+    int64_t size() const;
+
+    WITH_META(malMemo);
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    struct Entry {
+        size_t      hash;
+        malValuePtr args; // a list
+        malValuePtr result;
+    };
+    typedef std::list<Entry> Entries;
+
+    struct Table {
+        Table(int64_t capacity)
+        : capacity(capacity), hits(0), misses(0), evictions(0) { }
+
+        Entries::iterator find(size_t hash, malValueIter argsBegin,
+                               malValueIter argsEnd);
+        void add(size_t hash, malValuePtr args, malValuePtr result);
+
+        const int64_t capacity; // or 0 for no limit
+        std::mutex    lock;
+        Entries       entries;  // the most recently used first
+        std::unordered_multimap<size_t, Entries::iterator> index;
+        int64_t       hits;
+        int64_t       misses;
+        int64_t       evictions;
+    };
+
+    const malValuePtr            m_fn;
+    const std::shared_ptr<Table> m_table;
+};
+
+// A set of functions, its methods, which dispatch on the type of their
+// first argument to the implementations extend gave for that type. The
+// type is looked for first in the :type of the value's metadata, then in
+// its shape if it's a record, then in the kind of value it is (:mal/list,
+// :mal/map and so on), and last of all under :mal/default.
+//
+// Like def!, extend must not be called while other threads might be
+// calling the protocol's methods.
+class malProtocol : public malValue {
+public:
+    // The implementations for one type tag, in the order of the methods,
+    // with NULL for those it has none for. They live as long as the
+    // protocol, so caches can point at them, and go stale once extend
+    // changes what the tag would find.
+    struct Impls {
+        Impls(uint32_t tag, const malValueVec& fns)
+        : tag(tag), fns(fns), isStale(false) { }
+
+        const uint32_t    tag;
+        const malValueVec fns;   // empty if the tag has no implementations
+        mutable std::atomic<bool> isStale;
+    };
+
+    // The last few Impls a call site or method found, checked before the
+    // protocol itself.
+    class Cache {
+    public:
+        Cache();
+
+        const Impls* find(uint32_t tag) const;
+        void remember(const Impls* impls);
+
+    private:
+        enum { Size = 4 };
+        std::atomic<const Impls*> m_impls[Size];
+        std::atomic<unsigned>     m_next;
+    };
+
+    malProtocol(const String& name,
+                malValueIter methodsBegin, malValueIter methodsEnd);
+    malProtocol(const malProtocol& that, malValuePtr meta);
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_state == static_cast<const malProtocol*>(rhs)->m_state;
+    }
+
+    virtual size_t hash() const {
+        return std::hash<const void*>()(m_state.get());
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#protocol(%s)", m_state->name.c_str());
+    }
+
+    const String& name() const { return m_state->name; }
+    const String& method(int index) const { return m_state->methods[index]; }
+
+    // The index of the method with this keyword, or -1.
+    int methodIndex(const String& hashKey) const;
+
+    // Sets the implementations for a type: fns maps method keywords to
+    // functions.
+    void extend(uint32_t tag, const malHash* fns);
+
+    // The implementations for value, or NULL if it has none.
+    const Impls* implsFor(const malValuePtr& value, Cache& cache) const;
+
+    // Calls a method on its first argument's implementation.
+    malValuePtr call(int method, Cache& cache,
+                     malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // The tag for a :type keyword, or for a record shape.
+    static uint32_t typeTag(const String& keyword);
+    static uint32_t typeTag(const malShape* shape);
+
+    WITH_META(malProtocol);
+
 private:
+    const Impls* resolve(uint32_t tag) const;
+
+    struct State {
+        std::mutex lock;
+        String     name;
+        StringVec  methods;  // as makeHashKey makes them
+        std::map<uint32_t, malValueVec>          extended;
+        std::map<uint32_t, const Impls*>         resolved;
+        std::vector<std::unique_ptr<Impls> >     all;
+    };
+
+    const std::shared_ptr<State> m_state;
+};
+
+// A method of a protocol, as defprotocol defines it.
+class malProtocolFn : public malApplicable {
+public:
+    malProtocolFn(malValuePtr protocol, int method);
+    malProtocolFn(const malProtocolFn& that, malValuePtr meta);
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const;
+
+    const malProtocol* protocol() const { return m_protocol; }
+    int method() const { return m_method; }
+
+    WITH_META(malProtocolFn);
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    const malValuePtr        m_protocolValue;
+    const malProtocol* const m_protocol;
+    const int                m_method;
+    mutable malProtocol::Cache m_cache;
+};
+
+// A vector or map which conj!, assoc! and dissoc! change in place, so that
+// building a collection doesn't copy it at every step. Only the thread
+// which made it may use it, and only until persistent! hands over what it
+// holds as an ordinary vector or map, which it does without copying.
+class malTransient : public malValue {
+public:
+    malTransient(const malVector* vector);
+    malTransient(const malHash* hash);
+    virtual ~malTransient();
+
+    void conj(malValueIter argsBegin, malValueIter argsEnd);
+    void assoc(malValueIter argsBegin, malValueIter argsEnd);
+    void dissoc(malValueIter argsBegin, malValueIter argsEnd);
+    malValuePtr persistent();
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#transient(%p)", this);
+    }
+
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    // Throws unless op may be used on this now.
+    void check(const char* op, bool isMap) const;
+
+    // Moves the items to a block with room for capacity of them.
+    void reserve(int capacity);
+
+    const bool            m_isMap;
+    bool                  m_isPersistent;
+    const std::thread::id m_owner;
+
+    // A vector's items are kept where malVector keeps them, after space
+    // for the object, so persistent! only has to construct it.
+    void*                 m_block;
+    malValuePtr*          m_items;
+    int                   m_count;
+    int                   m_capacity;
+
+    malHash::Map          m_map;
+};
+
+class malFuture : public malValue {
+public:
+    typedef std::function<malValuePtr ()> Body;
+
+    malFuture(Body body);
+    malFuture(const malFuture& that, malValuePtr meta);
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#future(%p)", this);
+    }
+
+    // Waits for the result, running the body on this thread if no worker
+    // has started it yet. Exceptions from the body are rethrown here.
+    malValuePtr deref();
+    bool isDone() const;
+
+    WITH_META(malFuture);
+
+private:
+    enum State { Pending, Running, Done };
+
+    struct Shared {
+        Shared(Body body) : body(body), state(Pending) { }
+
+        bool claim();
+        void run();
+
+        Body                    body;
+        State                   state;
+        malValuePtr             value;
+        std::exception_ptr      error;
+        std::mutex              lock;
+        std::condition_variable done;
+    };
+
+    std::shared_ptr<Shared> m_shared;
+};
+
+// A call which the analysis pass has worked out ahead of time: an integer
+// builtin applied to constants. It stands for its value until one of the
+// builtins it could have used is rebound, after which it evaluates the
+// original form as usual.
+class malFolded : public malValue {
+public:
+    malFolded(malValuePtr form, malValuePtr value);
+    malFolded(const malFolded& that, malValuePtr meta);
+
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const { return false; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        const malFolded* that = static_cast<const malFolded*>(rhs);
+        return m_form->isEqualTo(that->m_form.ptr());
+    }
+
+    virtual size_t hash() const { return m_form->hash(); }
+
+    virtual String print(bool readably) const {
+        return m_form->print(readably);
+    }
+
+    malValuePtr value() const { return m_value; }
+
+    // Called for every def!, so that binding a new + or the like
+    // invalidates whatever was folded with the old one.
+    static void noteBinding(const String& name) {
+        if (isFoldable(name)) {
+            ++s_epoch;
+        }
+    }
+    static bool isFoldable(const String& name);
+
+    WITH_META(malFolded);
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    malValuePtr m_form;
     malValuePtr m_value;
+    const int   m_epoch;
+
+    static std::atomic<int> s_epoch;
+};
+
+// An fn* form whose body the analysis pass could see all of. The lambdas
+// it makes keep hold of copies of the locals the body uses, rather than of
+// every frame around them, so they don't keep anything else alive.
+class malFnForm : public malValue {
+public:
+    malFnForm(malValuePtr form, const StringVec& params,
+              const StringVec& captures, int depth);
+    malFnForm(const malFnForm& that, malValuePtr meta);
+
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const { return false; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        const malFnForm* that = static_cast<const malFnForm*>(rhs);
+        return m_form->isEqualTo(that->m_form.ptr());
+    }
+
+    virtual size_t hash() const { return m_form->hash(); }
+
+    virtual String print(bool readably) const {
+        return m_form->print(readably);
+    }
+
+    WITH_META(malFnForm);
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    const malValuePtr m_form;
+    const StringVec   m_params;
+    const StringVec   m_captures; // the locals the body refers to
+    const int         m_depth;    // frames between the form and its globals
+};
+
+// A quasiquote template which the analysis pass has compiled. It builds
+// the list the expansion would have, straight from its parts: constants,
+// which are used as they are, and unquoted forms, which are evaluated, and
+// spliced in if they were splice-unquoted.
+class malTemplate : public malValue {
+public:
+    enum Kind { Constant, Unquote, Splice };
+
+    struct Part {
+        Part(Kind kind, malValuePtr value) : kind(kind), value(value) { }
+
+        Kind        kind;
+        malValuePtr value;
+    };
+    typedef std::vector<Part> Parts;
+
+    malTemplate(malValuePtr form, const Parts& parts);
+    malTemplate(const malTemplate& that, malValuePtr meta);
+
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const { return false; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        const malTemplate* that = static_cast<const malTemplate*>(rhs);
+        return m_form->isEqualTo(that->m_form.ptr());
+    }
+
+    virtual size_t hash() const { return m_form->hash(); }
+
+    virtual String print(bool readably) const {
+        return m_form->print(readably);
+    }
+
+    WITH_META(malTemplate);
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    const malValuePtr m_form;
+    const Parts       m_parts;
+    int               m_evaluated; // parts which aren't constants
+};
+
+// A call of get, or of assoc with one key, whose key is a keyword, which
+// the analysis pass found. The site remembers which slot that key was in
+// for the last shape of record it saw, so another record of that shape
+// needs no lookup. Anything else goes through the map as the builtin
+// would, and once get or assoc has been rebound, the site evaluates its
+// original form instead.
+class malFieldSite : public malValue {
+public:
+    malFieldSite(malValuePtr form, malValuePtr target, malValuePtr key,
+                 malValuePtr value);
+    malFieldSite(const malFieldSite& that, malValuePtr meta);
+
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const { return false; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        const malFieldSite* that = static_cast<const malFieldSite*>(rhs);
+        return m_form->isEqualTo(that->m_form.ptr());
+    }
+
+    virtual size_t hash() const { return m_form->hash(); }
+
+    virtual String print(bool readably) const {
+        return m_form->print(readably);
+    }
+
+    // Called for every def!, so that binding a new get or assoc sends
+    // every site back to its original form.
+    static void noteBinding(const String& name) {
+        if ((name == "get") || (name == "assoc")) {
+            ++s_epoch;
+        }
+    }
+
+    WITH_META(malFieldSite);
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    int slotFor(const malShape* shape) const;
+
+    const malValuePtr m_form;
+    const malValuePtr m_target;
+    const malValuePtr m_key;
+    const malValuePtr m_value;   // NULL for get
+    const String      m_hashKey;
+    const int         m_epoch;
+
+    // The id of the last shape seen, above the slot it has the key in.
+    mutable std::atomic<uint64_t> m_cache;
+
+    static std::atomic<int> s_epoch;
+};
+
+// A call of a protocol method which the analysis pass found. It keeps a
+// cache of its own, so that each call site only sees the types that pass
+// through it. If the head no longer names the same method, the site
+// evaluates its original form instead.
+class malDispatchSite : public malValue {
+public:
+    malDispatchSite(malValuePtr form, malValuePtr fn);
+    malDispatchSite(const malDispatchSite& that, malValuePtr meta);
+
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual bool isLiteral() const { return false; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        const malDispatchSite* that = static_cast<const malDispatchSite*>(rhs);
+        return m_form->isEqualTo(that->m_form.ptr());
+    }
+
+    virtual size_t hash() const { return m_form->hash(); }
+
+    virtual String print(bool readably) const {
+        return m_form->print(readably);
+    }
+
+    WITH_META(malDispatchSite);
+
+protected:
+    virtual void freezeChildren();
+
+private:
+    const malValuePtr    m_form;
+    const malValuePtr    m_fn;
+    const malProtocolFn* m_method;
+    mutable malProtocol::Cache m_cache;
 };
 
 namespace mal {
     malValuePtr atom(malValuePtr value);
     malValuePtr boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
+    malValuePtr compiledFn(malCompiledFn::Code code, malEnvPtr env,
+                           const malValueVec& captures);
+    malValuePtr dispatchSite(malValuePtr form, malValuePtr fn);
     malValuePtr falseValue();
+    malValuePtr fieldSite(malValuePtr form, malValuePtr target,
+                          malValuePtr key, malValuePtr value);
+    malValuePtr fnForm(malValuePtr form, const StringVec& params,
+                       const StringVec& captures, int depth);
+    malValuePtr folded(malValuePtr form, malValuePtr value);
+    malValuePtr future(malFuture::Body body);
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
     malValuePtr hash(const malHash::Map& map);
+    malValuePtr hash(malHash::Map&& map);
     malValuePtr integer(int64_t value);
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
@@ -362,10 +1142,20 @@ namespace mal {
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
+    malValuePtr listTemplate(malValuePtr form,
+                             const malTemplate::Parts& parts);
     malValuePtr macro(const malLambda& lambda);
+    malValuePtr memo(malValuePtr fn, int64_t capacity);
     malValuePtr nilValue();
+    malValuePtr protocol(const String& name,
+                         malValueIter methodsBegin, malValueIter methodsEnd);
+    malValuePtr protocolFn(malValuePtr protocol, int method);
+    malValuePtr record(malValuePtr shape,
+                       malValueIter valuesBegin, malValueIter valuesEnd);
+    malValuePtr shape(malValueIter keysBegin, malValueIter keysEnd);
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
+    malValuePtr transient(malValuePtr collection);
     malValuePtr trueValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
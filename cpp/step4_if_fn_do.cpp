@@ -123,10 +123,10 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     malValuePtr op = items->at(0);
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
         return EVAL(lambda->getBody(),
-                    lambda->makeEnv(items->begin()+1, items->end()));
+                    lambda->makeEnv(beginOf(*items)+1, endOf(*items)));
     }
     else {
-        return APPLY(op, items->begin()+1, items->end());
+        return APPLY(op, beginOf(*items)+1, endOf(*items));
     }
 }
 
@@ -135,7 +135,8 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -1,52 +1,99 @@
 #include "MAL.h"
 
+#include "ArgStack.h"
 #include "Environment.h"
+#include "Interpreter.h"
+#include "Jit.h"
 #include "ReadLine.h"
+#include "Server.h"
 #include "Types.h"
 
 #include <iostream>
 #include <memory>
+#include <string.h>
 
 malValuePtr READ(const String& input);
 String PRINT(malValuePtr ast);
-static void installFunctions(malEnvPtr env);
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
-static String safeRep(const String& input, malEnvPtr env);
+static String safeRep(const String& input, Interpreter& interpreter);
+static int runServer(Interpreter& root, const char* socketPath,
+                     int fileCount, char* files[]);
+static int runForkServer(Interpreter& root, int argc, char* argv[]);
 static malValuePtr quasiquote(malValuePtr obj);
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
-static void installMacros(malEnvPtr env);
+static malValuePtr macroExpand(malValuePtr obj, const malEnvPtr& env);
 
-static ReadLine s_readLine("~/.mal-history");
-
-static malEnvPtr replEnv(new malEnv);
+static ReadLine& readLine()
+{
+    // Created on first use, so that runs which never read from the
+    // terminal don't load the history file.
+    static ReadLine s_readLine("~/.mal-history");
+    return s_readLine;
+}
 
 int main(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
-    installCore(replEnv);
-    installFunctions(replEnv);
-    installMacros(replEnv);
-    makeArgv(replEnv, argc - 2, argv + 2);
+    Interpreter interpreter;
+    interpreter.setInput([](const String& prompt, String& line) {
+        return readLine().get(prompt, line);
+    });
+    if ((argc > 1) && (strcmp(argv[1], "--jit-stats") == 0)) {
+        atexit([] { std::cerr << jitStats() << "\n"; });
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "--ref-stats") == 0)) {
+        atexit([] {
+            int64_t writes = RefCounted::writeCount();
+            std::cerr << (writes < 0 ? String("refcounts: not counted, "
+                                              "build with REFCOUNTS=1")
+                                     : STRF("refcounts: %lld writes",
+                                            (long long)writes)) << "\n";
+            std::cerr << STRF("deferred frees: %lld objects, "
+                              "longest pause %lld us\n",
+                              (long long)RefCounted::deferredCount(),
+                              (long long)RefCounted::longestPauseNs() / 1000);
+        });
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "--version") == 0)) {
+        // Does nothing beyond starting up, which makes it handy for timing
+        // just that.
+        std::cout << "Mal [C++]\n";
+        return 0;
+    }
+    if ((argc > 2) && (strcmp(argv[1], "--serve") == 0)) {
+        return runServer(interpreter, argv[2], argc - 3, argv + 3);
+    }
+    if ((argc > 1) && (strcmp(argv[1], "--fork-server") == 0)) {
+        return runForkServer(interpreter, argc - 2, argv + 2);
+    }
+    makeArgv(interpreter.env(), argc - 2, argv + 2);
     if (argc > 1) {
         String filename = escape(argv[1]);
-        safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+        safeRep(STRF("(load-file %s)", filename.c_str()), interpreter);
         return 0;
     }
-    rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
-    while (s_readLine.get(prompt, input)) {
-        String out = safeRep(input, replEnv);
+    interpreter.rep("(println (str \"Mal [\" *host-language* \"]\"))");
+    while (readLine().get(prompt, input)) {
+        String out = safeRep(input, interpreter);
         if (out.length() > 0)
             std::cout << out << "\n";
+        while (RefCounted::drainDeferred()) {
+        }
     }
     return 0;
 }
 
-static String safeRep(const String& input, malEnvPtr env)
+static String safeRep(const String& input, Interpreter& interpreter)
 {
     try {
-        return rep(input, env);
+        return interpreter.rep(input);
     }
     catch (malEmptyInputException&) {
         return String();
@@ -56,6 +103,58 @@ static String safeRep(const String& input, malEnvPtr env)
     };
 }
 
+// Loads the given files into root, then serves requests against it until
+// killed. Each connection evaluates in its own child of root.
+static int runServer(Interpreter& root, const char* socketPath,
+                     int fileCount, char* files[])
+{
+    try {
+        for (int i = 0; i < fileCount; i++) {
+            root.eval(STRF("(load-file %s)", escape(files[i]).c_str()));
+        }
+        serve(root, socketPath);
+    }
+    catch (String& s) {
+        std::cerr << s << "\n";
+    }
+    catch (malValuePtr& o) {
+        std::cerr << o->print(true) << "\n";
+    };
+    return 1;
+}
+
+// --fork-server [--no-freeze] [--load FILE]... SCRIPT...
+static int runForkServer(Interpreter& root, int argc, char* argv[])
+{
+    bool freeze = true;
+    StringVec scripts;
+    try {
+        for (int i = 0; i < argc; i++) {
+            if (strcmp(argv[i], "--no-freeze") == 0) {
+                freeze = false;
+            }
+            else if ((strcmp(argv[i], "--load") == 0) && (i + 1 < argc)) {
+                String filename = escape(argv[++i]);
+                root.eval(STRF("(load-file %s)", filename.c_str()));
+            }
+            else {
+                scripts.push_back(argv[i]);
+            }
+        }
+        if (freeze) {
+            root.env()->freeze();
+        }
+        return forkScripts(root, scripts) == 0 ? 0 : 1;
+    }
+    catch (String& s) {
+        std::cerr << s << "\n";
+    }
+    catch (malValuePtr& o) {
+        std::cerr << o->print(true) << "\n";
+    };
+    return 1;
+}
+
 static void makeArgv(malEnvPtr env, int argc, char* argv[])
 {
     malValueVec* args = new malValueVec();
@@ -67,7 +166,7 @@ static void makeArgv(malEnvPtr env, int argc, char* argv[])
 
 String rep(const String& input, malEnvPtr env)
 {
-    return PRINT(EVAL(READ(input), env));
+    return PRINT(EVAL(analyze(READ(input), env), env));
 }
 
 malValuePtr READ(const String& input)
@@ -75,10 +174,20 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
+// Evaluates an argument or the like, which is usually a symbol or a
+// constant, without copying env into a call to EVAL for those.
+static malValuePtr evalForm(const malValuePtr& ast, const malEnvPtr& env)
+{
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    return (list && !list->isEmpty()) ? EVAL(ast, env) : ast->eval(env);
+}
+
 malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 {
     if (!env) {
-        env = replEnv;
+        Interpreter* interpreter = Interpreter::current();
+        MAL_CHECK(interpreter != NULL, "eval needs a current interpreter");
+        env = interpreter->env();
     }
     while (1) {
         const malList* list = DYNAMIC_CAST(malList, ast);
@@ -86,7 +195,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             return ast->eval(env);
         }
 
-        ast = macroExpand(ast, env);
+        ast = macroExpand(std::move(ast), env);
         list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
@@ -95,7 +204,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
         if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
+            const String& special = symbol->value();
             int argCount = list->count() - 1;
 
             if (special == "def!") {
@@ -141,7 +250,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             if (special == "if") {
                 checkArgsBetween("if", 2, 3, argCount);
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
+                bool isTrue = evalForm(list->item(1), env)->isTrue();
                 if (!isTrue && (argCount == 2)) {
                     return mal::nilValue();
                 }
@@ -158,7 +267,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 for (int i = 0; i < count; i += 2) {
                     const malSymbol* var =
                         VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                    inner->bindLocal(var->value(),
+                                     EVAL(bindings->item(i+1), inner));
                 }
                 ast = list->item(2);
                 env = inner;
@@ -216,7 +326,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 if (excVal) {
                     // we got some exception
                     env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
+                    env->bindLocal(excSym->value(), excVal);
                     ast = catchBlock->item(2);
                 }
                 continue; // TCO
@@ -224,15 +334,34 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         }
 
         // Now we're left with the case of a regular list to be evaluated.
-        std::unique_ptr<malValueVec> items(list->evalItems(env));
-        malValuePtr op = items->at(0);
-        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+        // Integer arithmetic goes by the value of the head, not its name,
+        // so redefining + just means the head isn't the builtin any more.
+        malValuePtr op = evalForm(list->item(0), env);
+        const malBuiltIn* builtIn = DYNAMIC_CAST(malBuiltIn, op);
+        if (builtIn && (builtIn->inlineOp() != malBuiltIn::NotInline) &&
+            (list->count() == 3)) {
+            malValuePtr lhs = evalForm(list->item(1), env);
+            return builtIn->applyInline(lhs, evalForm(list->item(2), env));
+        }
+
+        ArgStack::Frame items(list->count());
+        items[0] = std::move(op);
+        for (int i = 1; i < list->count(); i++) {
+            items[i] = evalForm(list->item(i), env);
+        }
+        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, items[0])) {
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            lambda->makeTailEnv(env, items.begin()+1, items.end());
+#ifdef MAL_JIT
+            malValuePtr result;
+            if (jitEnter(lambda, ast, env, result)) {
+                return result;
+            }
+#endif
             continue; // TCO
         }
         else {
-            return APPLY(op, items->begin()+1, items->end());
+            return APPLY(items[0], items.begin()+1, items.end());
         }
     }
 }
@@ -242,7 +371,8 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -251,13 +381,13 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+static bool isSymbol(const malValuePtr& obj, const String& text)
 {
     const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
     return sym && (sym->value() == text);
 }
 
-static const malSequence* isPair(malValuePtr obj)
+static const malSequence* isPair(const malValuePtr& obj)
 {
     const malSequence* list = DYNAMIC_CAST(malSequence, obj);
     return list && !list->isEmpty() ? list : NULL;
@@ -297,13 +427,13 @@ static malValuePtr quasiquote(malValuePtr obj)
     }
 }
 
-static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
+static const malLambda* isMacroApplication(const malValuePtr& obj,
+                                           const malEnvPtr& env)
 {
     if (const malSequence* seq = isPair(obj)) {
-        if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->first())) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+        if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
+            if (const malValuePtr* value = env->lookup(sym->value())) {
+                if (malLambda* lambda = DYNAMIC_CAST(malLambda, *value)) {
                     return lambda->isMacro() ? lambda : NULL;
                 }
             }
@@ -312,7 +442,7 @@ static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
     return NULL;
 }
 
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+static malValuePtr macroExpand(malValuePtr obj, const malEnvPtr& env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
         const malSequence* seq = STATIC_CAST(malSequence, obj);
@@ -321,44 +451,8 @@ static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
     return obj;
 }
 
-static const char* macroTable[] = {
-    "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
-    "(defmacro! or (fn* (& xs) (if (empty? xs) nil (if (= 1 (count xs)) (first xs) (let* (condvar (gensym)) `(let* (~condvar ~(first xs)) (if ~condvar ~condvar (or ~@(rest xs)))))))))",
-};
-
-static void installMacros(malEnvPtr env)
-{
-    for (auto &macro : macroTable) {
-        rep(macro, env);
-    }
-}
-
 malValuePtr readline(const String& prompt)
 {
-    String input;
-    if (s_readLine.get(prompt, input)) {
-        return mal::string(input);
-    }
-    return mal::nilValue();
-}
-
-static const char* malFunctionTable[] = {
-    "(def! list (fn* (& items) items))",
-    "(def! not (fn* (cond) (if cond false true)))",
-    "(def! >= (fn* (a b) (<= b a)))",
-    "(def! < (fn* (a b) (not (<= b a))))",
-    "(def! > (fn* (a b) (not (<= a b))))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \")\")))))",
-    "(def! map (fn* (f xs) (if (empty? xs) xs \
-        (cons (f (first xs)) (map f (rest xs))))))",
-    "(def! *gensym-counter* (atom 0))",
-    "(def! gensym (fn* [] (symbol (str \"G__\" (swap! *gensym-counter* (fn* [x] (+ 1 x)))))))",
-    "(def! *host-language* \"C++\")",
-};
-
-static void installFunctions(malEnvPtr env) {
-    for (auto &function : malFunctionTable) {
-        rep(function, env);
-    }
+    Interpreter* interpreter = Interpreter::current();
+    return interpreter ? interpreter->readLine(prompt) : mal::nilValue();
 }
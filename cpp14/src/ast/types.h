@@ -90,7 +90,7 @@ namespace mal {
     };
 
     PRIMITIVE_TYPE(Boolean, bool);
-    PRIMITIVE_TYPE(Integer, int32_t);
+    PRIMITIVE_TYPE(Integer, int64_t);
     PRIMITIVE_TYPE(String,  std::string);
     PRIMITIVE_TYPE(Symbol,  std::string);
     PRIMITIVE_TYPE(Keyword, std::string);
@@ -129,10 +129,10 @@ ParseResult Parser::readAtom() {
     return Left<ParseError>(ParseError(token, "Empty token encountered"));
 
   } else if (isIntegerString(token.value)) {
-    return buildAST(ast::Integer, std::atoi(token.value.c_str()));
+    return buildAST(ast::Integer, std::atoll(token.value.c_str()));
 
   } else if (token.value[0] == '-' && token.value.size() > 1 && isIntegerString(token.value.substr(1))) {
-    return buildAST(ast::Integer, -std::atoi(token.value.substr(1).c_str()));
+    return buildAST(ast::Integer, -std::atoll(token.value.substr(1).c_str()));
 
   } else if (token.value[0] == ';') {
     return buildASTAtom(ast::Comment);
@@ -1,5 +1,6 @@
 #include "core.h"
 
+#include <chrono>
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -368,5 +369,29 @@ const std::unordered_map<std::string, internal::FuncLambda> runtime::ns = {
           RTN_VALUE(std::make_shared<ast::List>(ast::NodeType::List, callsite->toDummyToken(), newList));
         }
       }
+    ),
+
+    NS_FUNC(
+      "time-ms",
+      {
+        ARG_COUNT(0);
+
+        using namespace std::chrono;
+        const auto now = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
+
+        RTN_NODE(Integer, now.count());
+      }
+    ),
+
+    NS_FUNC(
+      "time-ns",
+      {
+        ARG_COUNT(0);
+
+        using namespace std::chrono;
+        const auto now = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch());
+
+        RTN_NODE(Integer, now.count());
+      }
     )
 };
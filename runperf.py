@@ -0,0 +1,195 @@
+#!/usr/bin/env python
+"""Run the tests/perf*.mal scripts against one or more implementations and
+emit the results as JSON.
+
+Each script is run several times. For every run the wall time and the peak
+resident set size of the child are recorded, and the per-script summary
+gives min/median/p99/stddev of the wall times. Lines printed by the
+perf.mal `bench` function, and the "Elapsed time" / "iters/s" lines of the
+older perf scripts, are collected from the output too.
+
+    ./runperf.py --impl cpp --impl cpp14 --runs 5 --out perf.json
+    ./runperf.py --baseline old.json --out new.json
+"""
+
+from __future__ import print_function
+import os, sys, re, glob, json, time
+import argparse
+import math
+import threading
+
+from subprocess import Popen, PIPE, STDOUT
+
+parser = argparse.ArgumentParser(
+        description="Run the perf*.mal scripts and report the results as JSON")
+parser.add_argument('--impl', action='append',
+        help="implementation to run (repeatable, default: cpp and cpp14)")
+parser.add_argument('--step', default=None,
+        help="step to run (default: stepA_mal, or the last one built)")
+parser.add_argument('--runs', default=5, type=int,
+        help="number of runs of each script")
+parser.add_argument('--tests', default='tests/perf*.mal',
+        help="glob of perf scripts, relative to the top of the tree")
+parser.add_argument('--timeout', default=300, type=int,
+        help="seconds allowed for a single run")
+parser.add_argument('--out', default=None,
+        help="write the JSON results here rather than to stdout")
+parser.add_argument('--baseline', default=None,
+        help="earlier JSON results to compare the median times against")
+
+BENCH_RE = re.compile(r'^bench (\S+) samples=(\d+) min=(\d+) median=(\d+) '
+                      r'p99=(\d+) stddev=(\d+)')
+ELAPSED_RE = re.compile(r'Elapsed time: (\d+) msecs')
+ITERS_RE = re.compile(r'iters/s: (\d+)')
+
+TOP = os.path.dirname(os.path.abspath(__file__))
+
+def summarise(values):
+    xs = sorted(values)
+    n = len(xs)
+    if n == 0:
+        return None
+    mean = float(sum(xs)) / n
+    return {
+        'min':    xs[0],
+        'median': xs[n // 2],
+        'p99':    xs[(99 * (n - 1)) // 100],
+        'stddev': int(math.sqrt(sum((x - mean) ** 2 for x in xs) / n)),
+    }
+
+def pick_step(impl, step):
+    if step:
+        return step
+    steps = sorted(os.path.basename(p) for p in
+                   glob.glob(os.path.join(TOP, impl, 'step*')))
+    steps = [s for s in steps if os.access(os.path.join(TOP, impl, s), os.X_OK)
+                                 and not os.path.isdir(os.path.join(TOP, impl, s))]
+    if 'stepA_mal' in steps or not steps:
+        return 'stepA_mal'
+    return steps[-1]
+
+def run_once(impl, step, test, timeout):
+    env = dict(os.environ, STEP=step)
+    cmd = ['../%s/run' % impl, '../%s' % test]
+    start = time.time()
+    proc = Popen(cmd, cwd=os.path.join(TOP, impl), env=env,
+                 stdout=PIPE, stderr=STDOUT)
+    timer = threading.Timer(timeout, proc.kill)
+    timer.start()
+    # Read to EOF ourselves and reap with wait4, which gives the resource
+    # usage of just this child.
+    output = proc.stdout.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall_ns = int((time.time() - start) * 1e9)
+    timer.cancel()
+    proc.returncode = status
+    if isinstance(output, bytes):
+        output = output.decode('utf-8', 'replace')
+
+    # ru_maxrss is in kilobytes on Linux and bytes on macOS.
+    rss_kb = usage.ru_maxrss
+    if sys.platform == 'darwin':
+        rss_kb //= 1024
+
+    return {
+        'status':  os.WEXITSTATUS(status) if os.WIFEXITED(status) else -1,
+        'wall_ns': wall_ns,
+        'rss_kb':  rss_kb,
+        'output':  output,
+    }
+
+def parse_output(output):
+    benches = []
+    metrics = {}
+    for line in output.splitlines():
+        m = BENCH_RE.match(line.strip())
+        if m:
+            benches.append({
+                'name':    m.group(1),
+                'samples': int(m.group(2)),
+                'min':     int(m.group(3)),
+                'median':  int(m.group(4)),
+                'p99':     int(m.group(5)),
+                'stddev':  int(m.group(6)),
+            })
+            continue
+        m = ELAPSED_RE.search(line)
+        if m:
+            metrics.setdefault('elapsed_ms', []).append(int(m.group(1)))
+        m = ITERS_RE.search(line)
+        if m:
+            metrics.setdefault('iters_per_sec', []).append(int(m.group(1)))
+    return benches, metrics
+
+def run_test(impl, step, test, runs, timeout):
+    result = {'impl': impl, 'step': step, 'test': test}
+    if not os.access(os.path.join(TOP, impl, step), os.X_OK):
+        result['status'] = 'not built'
+        return result
+
+    walls, rss, last = [], [], None
+    for _ in range(runs):
+        last = run_once(impl, step, test, timeout)
+        if last['status'] != 0:
+            result['status'] = 'failed'
+            result['output'] = last['output'][-2000:]
+            return result
+        walls.append(last['wall_ns'])
+        rss.append(last['rss_kb'])
+
+    benches, metrics = parse_output(last['output'])
+    result.update({
+        'status':      'ok',
+        'runs':        runs,
+        'wall_ns':     summarise(walls),
+        'peak_rss_kb': max(rss),
+        'benches':     benches,
+        'metrics':     metrics,
+    })
+    return result
+
+def compare(baseline, results):
+    old = {}
+    for r in baseline.get('results', []):
+        if r.get('status') == 'ok':
+            old[(r['impl'], r['test'])] = r['wall_ns']['median']
+    for r in results:
+        key = (r['impl'], r['test'])
+        if r.get('status') != 'ok' or key not in old:
+            continue
+        change = 100.0 * (r['wall_ns']['median'] - old[key]) / old[key]
+        print('%-8s %-24s %+7.1f%% median wall time' % (r['impl'], r['test'],
+                                                       change),
+              file=sys.stderr)
+
+def main():
+    args = parser.parse_args()
+    impls = args.impl or ['cpp', 'cpp14']
+    tests = sorted(os.path.relpath(p, TOP)
+                   for p in glob.glob(os.path.join(TOP, args.tests)))
+
+    results = []
+    for impl in impls:
+        step = pick_step(impl, args.step)
+        for test in tests:
+            print('Running %s %s %s' % (impl, step, test), file=sys.stderr)
+            results.append(run_test(impl, step, test, args.runs, args.timeout))
+
+    report = {
+        'timestamp': int(time.time()),
+        'runs':      args.runs,
+        'results':   results,
+    }
+    text = json.dumps(report, indent=2, sort_keys=True)
+    if args.out:
+        with open(args.out, 'w') as f:
+            f.write(text + '\n')
+    else:
+        print(text)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            compare(json.load(f), results)
+
+if __name__ == '__main__':
+    main()